@@ -0,0 +1,52 @@
+#ifndef TAIR_CONTEST_INCLUDE_TRACE_H_
+#define TAIR_CONTEST_INCLUDE_TRACE_H_
+
+#include <cstdint>
+
+/*
+ *  Binary trace of DB requests, written by the recording shim enabled
+ *  with Options::trace_path and replayed by the judge.
+ *
+ *  A trace is a trace_header followed by blocks. Every block holds
+ *  consecutive requests issued by one client thread, in issue order, so
+ *  a replayer can split the file by thread by walking block headers only.
+ *  Blocks of different threads are interleaved in the order they filled.
+ *  A trace cut short by a crash keeps its complete blocks.
+ */
+
+static const char TRACE_MAGIC[8] = {'K', 'V', 'T', 'R', 'A', 'C', 'E', '1'};
+
+enum TraceOp : uint8_t {
+    TRACE_GET = 1,
+    TRACE_SET = 2
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_value_size;    /* largest value_size of any record */
+    uint64_t record_num;        /* 0 if the recorder did not close cleanly */
+    uint64_t block_num;
+};
+
+struct trace_block {
+    uint32_t thread;            /* client thread slot, stable for the life of the thread */
+    uint32_t record_num;        /* trace_record entries that follow */
+};
+
+/*
+ *  One request, 32 bytes. Batched calls are recorded as one record per key.
+ */
+struct trace_record {
+    uint64_t time_ns;           /* issue time since the recorder was created */
+    uint32_t value_size;        /* Set: length of the value, Get: 0 */
+    uint8_t op;                 /* TraceOp */
+    uint8_t reserved[3];
+    char key[16];
+};
+
+static_assert(sizeof(trace_header) == 32, "trace_header layout");
+static_assert(sizeof(trace_block) == 8, "trace_block layout");
+static_assert(sizeof(trace_record) == 32, "trace_record layout");
+
+#endif
@@ -2,30 +2,60 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <string>
 #include <random>
 #include <atomic>
+#include <chrono>
 #include <immintrin.h>
 #include "random.h"
+#include "workload.h"
+#include "latency.h"
 #include "db.hpp"
+#include "trace.hpp"
+#include "crc32c.hpp"
 
 using namespace std;
 
 static const int KEY_SIZE = 16;
 static const int VALUE_SIZE = 80;
 
-static const int NUM_THREADS = 16;          /* 16T */
+static const int MAX_THREADS = 64;
+static int NUM_THREADS = 16;                /* 16T */
 static int PER_SET = 48000000;
 static int PER_GET = 48000000;
 static const uint64_t BASE = 199997;
 static struct timeval TIME_START, TIME_END;
-static const int MAX_KEY_POOL_SIZE = 1e4 * 10;
-static const int MAX_VAL_POOL_SIZE = 1e4 * 10 * 5;
+static uint64_t KEY_SPACE = 5e4;            /* keys kept for the get phase, or records loaded by a workload */
 static int KEY_POOL_TOP = 0;
-static uint64_t key_pool[MAX_KEY_POOL_SIZE];    /* All generated key */
+static uint64_t* key_pool = nullptr;        /* All generated key, 2 words per key */
 static int VAL_POOL_TOP = 0;
-static uint64_t val_pool[MAX_VAL_POOL_SIZE];    /* All Generated value */
-static int MODE = 1;
+static uint64_t* val_pool = nullptr;        /* All Generated value, 10 words per value */
+static int MODE = 1;                        /* 1: contest phases, 2: workload, 3: trace replay, 4: checksum, 5: restart, 6: writers, 7: layouts */
+static Workload WORKLOAD;                   /* mix used in mode 2 */
+static KeyDist KEY_DIST;
+static bool KEY_DIST_SET = false;           /* -d overrides the distribution of the mix */
+static uint64_t OPS_PER_THREAD = 1000000;   /* requests per thread in the run phase of mode 2 */
+static string TIMELINE_PATH = "./timeline.csv";  /* per-second throughput of every phase */
+static string TRACE_PATH;                   /* trace replayed in mode 3 */
+static double REPLAY_SPEED = 0;             /* > 0 keeps the recorded timing scaled by this factor, 0 replays flat out */
+static string RECORD_PATH;                  /* record the requests of this run to a trace */
+static uint64_t CACHE_SIZE = 0;             /* MB of DRAM read cache, 0 disables it */
+static const int MAX_BATCH = 64;
+static int BATCH = 1;                       /* > 1 drives DB::MultiGet / DB::MultiSet */
+static int QUEUE_DEPTH = 0;                 /* > 0 issues the reads of mode 2 through DB::SubmitGet */
+static int NUMA_NODES = 0;                  /* > 0 shards the engine into ./DB.<node> files */
+static int PREFAULT_THREADS = 0;            /* > 0 faults in the mappings with that many threads at open */
+static bool HUGE_PAGES = false;             /* ask for huge pages on the mappings */
+static Options DURABILITY;                  /* durability level and group persist limits, set with -D */
+static uint32_t CHECKPOINT_SEC = 0;         /* seconds between index checkpoints, 0 disables them */
+static uint32_t ASYNC_FLUSHERS = 0;         /* > 0 queues Sets to that many background flusher threads */
+static bool IN_PLACE = false;               /* overwrite existing records in place */
+static Layout LAYOUT = LayoutBucket;        /* PMem layout of the DB, set with -L */
 
 static DB* db = nullptr;
 static vector<uint16_t> pool_seed[16];
@@ -37,12 +67,104 @@ static uint64_t seed[] = {
 };
 
 #define PUT_KEY_TO_POOL(addr) \
-    memcpy(key_pool + KEY_POOL_TOP, addr, KEY_SIZE); \
-    KEY_POOL_TOP += 2;
+    if ((uint64_t) KEY_POOL_TOP + 2 <= KEY_SPACE * 2) { \
+        memcpy(key_pool + KEY_POOL_TOP, addr, KEY_SIZE); \
+        KEY_POOL_TOP += 2; \
+    }
 
 #define PUT_VAL_TO_POOL(addr) \
-    memcpy(val_pool + VAL_POOL_TOP, addr, VALUE_SIZE); \
-    VAL_POOL_TOP += 10;
+    if ((uint64_t) VAL_POOL_TOP + 10 <= KEY_SPACE * 10) { \
+        memcpy(val_pool + VAL_POOL_TOP, addr, VALUE_SIZE); \
+        VAL_POOL_TOP += 10; \
+    }
+
+enum LatencyType {
+    LAT_GET,
+    LAT_SET,
+    LAT_MULTI_GET,
+    LAT_MULTI_SET,
+    LAT_TYPE_NUM
+};
+static const char* LAT_NAMES[LAT_TYPE_NUM] = {"Get", "Set", "MultiGet", "MultiSet"};
+
+/**
+ * Latency and progress of one thread. Only the owner writes; the timeline
+ * sampler reads ops concurrently, so they are atomics updated without RMW.
+ * Batched calls record one latency per call and count every key in ops.
+ */
+struct thread_stat_t {
+    LatencyHistogram hist[LAT_TYPE_NUM];
+    std::atomic<uint64_t> ops[LAT_TYPE_NUM];
+} __attribute__((aligned(64)));
+static thread_stat_t thread_stats[MAX_THREADS];
+static thread_local thread_stat_t* local_stat = nullptr;
+static Timeline* timeline = nullptr;
+
+static inline uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void record_latency(LatencyType type, uint64_t start, uint64_t ops = 1) {
+    local_stat->hist[type].record(now_ns() - start);
+    local_stat->ops[type].store(local_stat->ops[type].load(std::memory_order_relaxed) + ops,
+                                std::memory_order_relaxed);
+}
+
+static void sum_ops(uint64_t *totals) {
+    for (int type = 0; type < LAT_TYPE_NUM; type++) {
+        totals[type] = 0;
+        for (int i = 0; i < NUM_THREADS; i++) {
+            totals[type] += thread_stats[i].ops[type].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Merge the histograms of all threads, print them in microseconds and
+ * reset them for the next phase. Called after the threads are joined.
+ */
+static void report_latency(const char *phase) {
+    printf("%s latency (us):\n", phase);
+    for (int type = 0; type < LAT_TYPE_NUM; type++) {
+        LatencyHistogram merged;
+        for (int i = 0; i < NUM_THREADS; i++) {
+            merged.merge(thread_stats[i].hist[type]);
+            thread_stats[i].hist[type] = LatencyHistogram();
+        }
+        if (merged.count() == 0) {
+            continue;
+        }
+        printf("  %-8s count %10lu  p50 %8.2lf  p99 %8.2lf  p99.9 %8.2lf  max %10.2lf\n", LAT_NAMES[type],
+               merged.count(), merged.percentile(0.5) / 1000.0, merged.percentile(0.99) / 1000.0,
+               merged.percentile(0.999) / 1000.0, merged.max() / 1000.0);
+    }
+}
+
+/**
+ * Engine-side counters queried through DB::GetProperty, skipped when the
+ * engine does not provide them.
+ */
+static void report_engine_stats() {
+    std::string user_bytes, media_bytes, flushes, drains, skew;
+    if (!db->GetProperty("nvm.user-bytes", &user_bytes) || !db->GetProperty("nvm.media-bytes", &media_bytes) ||
+        !db->GetProperty("nvm.flushes", &flushes) || !db->GetProperty("nvm.drains", &drains) ||
+        !db->GetProperty("nvm.bucket-skew", &skew)) {
+        return;
+    }
+    uint64_t user = strtoull(user_bytes.c_str(), nullptr, 10);
+    printf("Engine: write amplification %.2lf, flushes %s, drains %s, bucket skew %s\n",
+           user ? (double) strtoull(media_bytes.c_str(), nullptr, 10) / user : 0.0,
+           flushes.c_str(), drains.c_str(), skew.c_str());
+    std::string index_bytes, resident_bytes, live_keys;
+    if (db->GetProperty("nvm.index-bytes", &index_bytes) && db->GetProperty("nvm.index-resident-bytes", &resident_bytes) &&
+        db->GetProperty("nvm.live-keys", &live_keys)) {
+        uint64_t resident = strtoull(resident_bytes.c_str(), nullptr, 10);
+        uint64_t live = strtoull(live_keys.c_str(), nullptr, 10);
+        printf("Engine: index %.2lf MB reserved, %.2lf MB resident, %.2lf bytes per live key\n",
+               strtoull(index_bytes.c_str(), nullptr, 10) / 1048576.0, resident / 1048576.0,
+               live ? (double) resident / live : 0.0);
+    }
+}
 
 static void init_pool_seed() {
     for(int i = 0; i < KEY_SIZE; i++) {
@@ -54,7 +176,122 @@ static void init_pool_seed() {
     }
 }
 
+/**
+ * Pending keys and values of one thread in batch mode. Random reuses its
+ * buffer, so keys and values are copied in before the batch is issued.
+ */
+struct batch_t {
+    char keys[MAX_BATCH][KEY_SIZE];
+    char values[MAX_BATCH][VALUE_SIZE];
+    int val_idx[MAX_BATCH];
+    Slice key_slices[MAX_BATCH];
+    Slice val_slices[MAX_BATCH];
+    Status statuses[MAX_BATCH];
+    int size;
+};
+
+static void batch_set(batch_t *batch) {
+    if (batch->size == 0) {
+        return;
+    }
+    for(int i = 0; i < batch->size; i++) {
+        batch->key_slices[i] = Slice(batch->keys[i], KEY_SIZE);
+        batch->val_slices[i] = Slice(batch->values[i], VALUE_SIZE);
+    }
+    uint64_t start = now_ns();
+    db->MultiSet(batch->size, batch->key_slices, batch->val_slices, batch->statuses);
+    record_latency(LAT_MULTI_SET, start, batch->size);
+    batch->size = 0;
+}
+
+static void batch_get(batch_t *batch) {
+    if (batch->size == 0) {
+        return;
+    }
+    for(int i = 0; i < batch->size; i++) {
+        batch->key_slices[i] = Slice(batch->keys[i], KEY_SIZE);
+        batch->val_slices[i] = Slice(batch->values[i], VALUE_SIZE);
+    }
+    uint64_t start = now_ns();
+    db->MultiGet(batch->size, batch->key_slices, batch->val_slices, batch->statuses);
+    record_latency(LAT_MULTI_GET, start, batch->size);
+    for(int i = 0; i < batch->size; i++) {
+        /* Consistency check */
+        if(memcmp(batch->values[i], (char*)(val_pool + batch->val_idx[i]), VALUE_SIZE) != 0) {
+            std::cout << "Check result failed. " << endl;
+            exit(1);
+        }
+    }
+    batch->size = 0;
+}
+
+static void* set_pure_batch(void * id) {
+    local_stat = &thread_stats[(long) id];
+    Random rnd;
+    batch_t *batch = new batch_t();
+    int cnt = PER_SET;
+    while (cnt--) {
+        unsigned int *start = rnd.nextUnsignedInt();
+        if (((cnt & 0x7777) ^ 0x7777) == 0) {
+            PUT_KEY_TO_POOL(start);
+            PUT_VAL_TO_POOL(start + 4);
+        }
+        memcpy(batch->keys[batch->size], start, KEY_SIZE);
+        memcpy(batch->values[batch->size], start + 4, VALUE_SIZE);
+        if (++batch->size == BATCH) {
+            batch_set(batch);
+        }
+    }
+    batch_set(batch);
+    delete batch;
+    return nullptr;
+}
+
+/**
+ * Same key distribution as get_pure, reads and writes are queued into
+ * separate batches. Reads target the middle of the pool and writes the
+ * edges, so a queued write never races with a queued read of the same key.
+ */
+static void* get_pure_batch(void *id) {
+    local_stat = &thread_stats[(long) id];
+    Random rnd;
+    mt19937 mt(23333);
+    double u = KEY_POOL_TOP / 2.0;
+    double o = KEY_POOL_TOP * 0.01;
+    int edge = (int) (KEY_POOL_TOP * 0.0196);
+    normal_distribution<double> n(u, o);
+    batch_t *reads = new batch_t();
+    batch_t *writes = new batch_t();
+    int cnt = PER_GET;
+    while(cnt --) {
+        int key_idx = ((int)n(mt) | 1) ^1;
+        key_idx %= KEY_POOL_TOP - 2;
+        int val_idx = (key_idx + (8 * (key_idx / 2)));
+        if(key_idx - u > edge || u - key_idx > edge) {
+            unsigned int* start = rnd.nextUnsignedInt();
+            memcpy(val_pool + val_idx, start, VALUE_SIZE);
+            memcpy(writes->keys[writes->size], key_pool + key_idx, KEY_SIZE);
+            memcpy(writes->values[writes->size], start, VALUE_SIZE);
+            if (++writes->size == BATCH) {
+                batch_set(writes);
+            }
+        } else {
+            memcpy(reads->keys[reads->size], key_pool + key_idx, KEY_SIZE);
+            reads->val_idx[reads->size] = val_idx;
+            if (++reads->size == BATCH) {
+                batch_get(reads);
+            }
+        }
+    }
+    batch_set(writes);
+    batch_get(reads);
+    delete reads;
+    delete writes;
+    return nullptr;
+}
+
 static void* set_pure(void * id) {
+    local_stat = &thread_stats[(long) id];
     Random rnd;
     int cnt = PER_SET;
     while (cnt--) {
@@ -66,12 +303,15 @@ static void* set_pure(void * id) {
             PUT_KEY_TO_POOL(start);
             PUT_VAL_TO_POOL(start + 4);
         }
+        uint64_t begin = now_ns();
         db->Set(data_key, data_value);
+        record_latency(LAT_SET, begin);
     }
     return nullptr;
 }
 
 static void* get_pure(void *id) {
+    local_stat = &thread_stats[(long) id];
     Random rnd;
     mt19937 mt(23333);
     double u = KEY_POOL_TOP / 2.0;
@@ -92,11 +332,15 @@ static void* get_pure(void *id) {
             Slice data_value((char*)start, 80);
             /* Put new value of key(key_idx) */
             memcpy(val_pool + val_idx, start, VALUE_SIZE);
+            uint64_t begin = now_ns();
             db->Set(data_key, data_value);
+            record_latency(LAT_SET, begin);
         } else {
             // 读
             Slice data_key((char*)(key_pool + key_idx), 16);
+            uint64_t begin = now_ns();
             db->Get(data_key, &value);
+            record_latency(LAT_GET, begin);
 
             /* Consistency check */
             if(strncmp(&value[0], (ans = (char*)(val_pool + val_idx)), VALUE_SIZE) != 0 ) {
@@ -112,25 +356,138 @@ static void* get_pure(void *id) {
     return nullptr;
 }
 
+/**
+ * "strict", "relaxed" or "group" optionally followed by ":<records>" and
+ * ":<microseconds>" overriding the group persist limits.
+ */
+static bool parse_durability(const char *arg, Options *options) {
+    if (strcmp(arg, "strict") == 0) {
+        options->durability = DurabilityStrict;
+    } else if (strcmp(arg, "relaxed") == 0) {
+        options->durability = DurabilityRelaxed;
+    } else if (strncmp(arg, "group", 5) == 0 && (arg[5] == '\0' || arg[5] == ':')) {
+        options->durability = DurabilityGroup;
+        unsigned records, us;
+        int n = sscanf(arg + 5, ":%u:%u", &records, &us);
+        if (n >= 1) {
+            options->group_persist_records = records;
+        }
+        if (n == 2) {
+            options->group_persist_us = us;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
 /**
  * Configuration input args
  */
 static void config_parse(int argc, char *argv[]) {
     int opt = 0;
-    while((opt = getopt(argc, argv, "hs:g:")) != -1) {
+    find_workload("a", &WORKLOAD);
+    while((opt = getopt(argc, argv, "hm:s:g:c:b:q:n:p:Ht:k:w:d:o:l:r:R:T:D:C:a:uL:")) != -1) {
         switch(opt) {
             case 'h':
-                printf("Usage: ./judge -s <set-size-per-Thread> -g <get-size-per-Thread>\n");
-                return ;
+                printf("Usage: ./judge [-m <mode>] [-t <threads>] [-k <key-space>] [-c <read-cache-MB>]"
+                       " [-b <batch-size>] [-q <get-queue-depth>] [-n <numa-nodes>] [-p <prefault-threads>] [-H] [-l <timeline-csv>]"
+                       " [-T <record-trace>] [-D <strict|group[:records[:us]]|relaxed>] [-C <checkpoint-sec>]"
+                       " [-a <async-flushers>] [-u] [-L <bucket|thread>]\n"
+                       "  mode 1 (contest): -s <set-size-per-Thread> -g <get-size-per-Thread>\n"
+                       "  mode 2 (workload): [-w <a-f>] [-d <uniform|zipfian|latest>] [-o <ops-per-Thread>]\n"
+                       "  mode 3 (replay): -r <trace> [-R <speed>]\n"
+                       "  mode 4 (checksum): cost of the per-record CRC32C, no DB is opened\n"
+                       "  mode 5 (restart): open time after a crash for up to -k keys, full scan vs checkpoint\n"
+                       "  mode 6 (writers): -k keys written by 1..-t writers, then by -t clients through 1..-t flushers\n"
+                       "  mode 7 (layouts): -k keys loaded, overwritten, read and reopened with both layouts\n");
+                exit(0);
             case 'm':
                 MODE = atoi(optarg);
                 break;
+            case 't':
+                NUM_THREADS = min(max(atoi(optarg), 1), MAX_THREADS);
+                break;
+            case 'k':
+                KEY_SPACE = max(atoll(optarg), 1ll);
+                break;
+            case 'w':
+                if (!find_workload(optarg, &WORKLOAD)) {
+                    printf("unknown workload %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                if (!parse_dist(optarg, &KEY_DIST)) {
+                    printf("unknown distribution %s\n", optarg);
+                    exit(1);
+                }
+                KEY_DIST_SET = true;
+                break;
+            case 'o':
+                OPS_PER_THREAD = atoll(optarg);
+                break;
+            case 'l':
+                TIMELINE_PATH = optarg;
+                break;
+            case 'r':
+                TRACE_PATH = optarg;
+                break;
+            case 'R':
+                REPLAY_SPEED = max(atof(optarg), 0.0);
+                break;
+            case 'T':
+                RECORD_PATH = optarg;
+                break;
             case 's':
                 PER_SET = atoi(optarg);
                 break;
             case 'g':
                 PER_GET = atoi(optarg);
                 break;
+            case 'c':
+                CACHE_SIZE = atoll(optarg);
+                break;
+            case 'b':
+                BATCH = min(max(atoi(optarg), 1), MAX_BATCH);
+                break;
+            case 'q':
+                QUEUE_DEPTH = min(max(atoi(optarg), 0), MAX_BATCH);
+                break;
+            case 'n':
+                NUMA_NODES = atoi(optarg);
+                break;
+            case 'p':
+                PREFAULT_THREADS = max(atoi(optarg), 0);
+                break;
+            case 'H':
+                HUGE_PAGES = true;
+                break;
+            case 'D':
+                if (!parse_durability(optarg, &DURABILITY)) {
+                    printf("unknown durability %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                CHECKPOINT_SEC = max(atoi(optarg), 0);
+                break;
+            case 'a':
+                ASYNC_FLUSHERS = max(atoi(optarg), 0);
+                break;
+            case 'u':
+                IN_PLACE = true;
+                break;
+            case 'L':
+                if (strcmp(optarg, "bucket") == 0) {
+                    LAYOUT = LayoutBucket;
+                } else if (strcmp(optarg, "thread") == 0) {
+                    LAYOUT = LayoutThread;
+                } else {
+                    printf("unknown layout %s\n", optarg);
+                    exit(1);
+                }
+                break;
             default:
                 break;
         }
@@ -142,7 +499,7 @@ static void config_parse(int argc, char *argv[]) {
  */
 static void test_set_pure(pthread_t * tids) {
     for(int i = 0; i < NUM_THREADS; ++i) {
-        if(pthread_create(&tids[i], nullptr, set_pure, seed + i) != 0) {
+        if(pthread_create(&tids[i], nullptr, BATCH > 1 ? set_pure_batch : set_pure, (void *) (long) i) != 0) {
             printf("create thread failed.\n");
             exit(1);
         }
@@ -158,7 +515,7 @@ static void test_set_pure(pthread_t * tids) {
  */
 static void test_set_get(pthread_t * tids) {
     for(int i = 0; i < NUM_THREADS; ++i) {
-        if(pthread_create(&tids[i], nullptr, get_pure, seed + i) != 0) {
+        if(pthread_create(&tids[i], nullptr, BATCH > 1 ? get_pure_batch : get_pure, (void *) (long) i) != 0) {
             printf("create thread failed.\n");
             exit(1);
         }
@@ -168,27 +525,732 @@ static void test_set_get(pthread_t * tids) {
     }
 }
 
+/**
+ * Workload mode: ids [0, KEY_SPACE) are loaded first, inserts of the run
+ * phase take the following ids. Reads are checked against the id they
+ * were issued for; an insert may still be in flight when another thread
+ * picks its id, so NotFound is only an error for loaded records.
+ */
+static std::atomic<uint64_t> record_count(0);  /* ids handed out so far */
+static ZipfianGenerator* zipf = nullptr;
+
+struct workload_stat_t {
+    uint64_t ops[OP_TYPE_NUM];
+    uint64_t not_found;
+    uint64_t set_failed;
+} __attribute__((aligned(64)));
+static workload_stat_t workload_stats[MAX_THREADS];
+
+static void check_read(uint64_t key_id, Status s, const char *value, workload_stat_t *stat) {
+    if (s == NotFound && key_id >= KEY_SPACE) {
+        stat->not_found++;
+        return;
+    }
+    if (s != Ok || !check_value(key_id, value)) {
+        std::cout << "Check result failed. " << endl;
+        exit(1);
+    }
+}
+
+static void* workload_load(void *id) {
+    long tid = (long) id;
+    local_stat = &thread_stats[tid];
+    Random rnd;
+    char key[KEY_SIZE];
+    char value[VALUE_SIZE];
+    for (uint64_t i = KEY_SPACE * tid / NUM_THREADS; i < KEY_SPACE * (tid + 1) / NUM_THREADS; i++) {
+        make_key(i, key);
+        make_value(i, 0, rnd.nextUnsignedInt(), value);
+        uint64_t start = now_ns();
+        db->Set(Slice(key, KEY_SIZE), Slice(value, VALUE_SIZE));
+        record_latency(LAT_SET, start);
+    }
+    return nullptr;
+}
+
+/**
+ * Reads of one thread queued with DB::SubmitGet in mode 2, like a front end
+ * that takes requests one by one. They are completed and checked when
+ * QUEUE_DEPTH are pending or before the thread issues anything else.
+ */
+struct get_queue_t {
+    char keys[MAX_BATCH][KEY_SIZE];
+    char values[MAX_BATCH][VALUE_SIZE];
+    uint64_t key_ids[MAX_BATCH];
+    uint64_t starts[MAX_BATCH];
+    Slice val_slices[MAX_BATCH];
+    Status statuses[MAX_BATCH];
+    int size;
+};
+
+static void complete_gets(get_queue_t *queue, workload_stat_t *stat) {
+    if (queue->size == 0) {
+        return;
+    }
+    db->CompleteGets();
+    for (int i = 0; i < queue->size; i++) {
+        record_latency(LAT_GET, queue->starts[i]);
+        check_read(queue->key_ids[i], queue->statuses[i], queue->values[i], stat);
+    }
+    queue->size = 0;
+}
+
+static void* workload_run(void *id) {
+    long tid = (long) id;
+    local_stat = &thread_stats[tid];
+    Random rnd;
+    mt19937_64 mt(seed[tid % 16] * (tid + 1));
+    KeyChooser chooser(KEY_DIST, zipf, &record_count);
+    workload_stat_t *stat = &workload_stats[tid];
+    char key[KEY_SIZE];
+    char value[VALUE_SIZE];
+    char keys[MAX_SCAN_LENGTH][KEY_SIZE];
+    char values[MAX_SCAN_LENGTH][VALUE_SIZE];
+    Slice key_slices[MAX_SCAN_LENGTH];
+    Slice val_slices[MAX_SCAN_LENGTH];
+    Status statuses[MAX_SCAN_LENGTH];
+    get_queue_t *queue = new get_queue_t();
+    queue->size = 0;
+    uint64_t version = 0;
+    for (uint64_t n = 0; n < OPS_PER_THREAD; n++) {
+        OpType op = next_op(WORKLOAD, mt);
+        if (op != OP_READ || queue->size == QUEUE_DEPTH) {
+            complete_gets(queue, stat);
+        }
+        uint64_t key_id = op == OP_INSERT ? record_count.fetch_add(1) : chooser.next(mt);
+        make_key(key_id, key);
+        Slice data_key(key, KEY_SIZE);
+        Slice data_value(value, VALUE_SIZE);
+        uint64_t start = now_ns();
+        switch (op) {
+            case OP_READ: {
+                if (QUEUE_DEPTH > 0) {
+                    int i = queue->size++;
+                    memcpy(queue->keys[i], key, KEY_SIZE);
+                    queue->key_ids[i] = key_id;
+                    queue->starts[i] = start;
+                    queue->val_slices[i] = Slice(queue->values[i], VALUE_SIZE);
+                    db->SubmitGet(Slice(queue->keys[i], KEY_SIZE), &queue->val_slices[i], &queue->statuses[i]);
+                    break;
+                }
+                Status s = db->Get(data_key, &data_value);
+                record_latency(LAT_GET, start);
+                check_read(key_id, s, value, stat);
+                break;
+            }
+            case OP_UPDATE:
+            case OP_INSERT:
+                make_value(key_id, ++version, rnd.nextUnsignedInt(), value);
+                start = now_ns();
+                stat->set_failed += db->Set(data_key, data_value) != Ok;
+                record_latency(LAT_SET, start);
+                break;
+            case OP_SCAN: {
+                uint64_t len = 1 + mt() % MAX_SCAN_LENGTH;
+                len = min(len, record_count.load(std::memory_order_relaxed) - key_id);
+                for (uint64_t i = 0; i < len; i++) {
+                    make_key(key_id + i, keys[i]);
+                    key_slices[i] = Slice(keys[i], KEY_SIZE);
+                    val_slices[i] = Slice(values[i], VALUE_SIZE);
+                }
+                start = now_ns();
+                db->MultiGet(len, key_slices, val_slices, statuses);
+                record_latency(LAT_MULTI_GET, start, len);
+                for (uint64_t i = 0; i < len; i++) {
+                    check_read(key_id + i, statuses[i], values[i], stat);
+                }
+                break;
+            }
+            case OP_RMW: {
+                Status s = db->Get(data_key, &data_value);
+                record_latency(LAT_GET, start);
+                check_read(key_id, s, value, stat);
+                make_value(key_id, (s == Ok ? value_version(value) : 0) + 1, rnd.nextUnsignedInt(), value);
+                start = now_ns();
+                stat->set_failed += db->Set(data_key, Slice(value, VALUE_SIZE)) != Ok;
+                record_latency(LAT_SET, start);
+                break;
+            }
+            default:
+                break;
+        }
+        stat->ops[op]++;
+    }
+    complete_gets(queue, stat);
+    delete queue;
+    return nullptr;
+}
+
+static void run_threads(pthread_t * tids, void* (*func)(void *), int threads = NUM_THREADS) {
+    for(long i = 0; i < threads; ++i) {
+        if(pthread_create(&tids[i], nullptr, func, (void *) i) != 0) {
+            printf("create thread failed.\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < threads; i++){
+        pthread_join(tids[i], nullptr);
+    }
+}
+
+static uint64_t elapsed_us(const struct timeval &start, const struct timeval &end) {
+    return 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
+}
+
+static void test_workload(pthread_t * tids) {
+    if (!KEY_DIST_SET) {
+        KEY_DIST = WORKLOAD.dist;
+    }
+    printf("workload %s, %s keys, %lu records, %d threads, %lu ops per thread\n",
+           WORKLOAD.name, dist_name(KEY_DIST), KEY_SPACE, NUM_THREADS, OPS_PER_THREAD);
+    zipf = new ZipfianGenerator(KEY_SPACE);
+
+    struct timeval start, end;
+    timeline->set_phase("load");
+    gettimeofday(&start, nullptr);
+    run_threads(tids, workload_load);
+    record_count.store(KEY_SPACE);
+    gettimeofday(&end, nullptr);
+    uint64_t sec_load = elapsed_us(start, end);
+    printf("Load: %.2lfms, %.2lf Mops/s\n", sec_load / 1000.0, (double) KEY_SPACE / max(sec_load, (uint64_t) 1));
+    report_latency("Load");
+
+    timeline->set_phase("run");
+    gettimeofday(&start, nullptr);
+    run_threads(tids, workload_run);
+    gettimeofday(&end, nullptr);
+    uint64_t sec_run = elapsed_us(start, end);
+    printf("Run: %.2lfms, %.2lf Mops/s\n", sec_run / 1000.0,
+           (double) OPS_PER_THREAD * NUM_THREADS / max(sec_run, (uint64_t) 1));
+    report_latency("Run");
+
+    workload_stat_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < NUM_THREADS; i++) {
+        for (int op = 0; op < OP_TYPE_NUM; op++) {
+            total.ops[op] += workload_stats[i].ops[op];
+        }
+        total.not_found += workload_stats[i].not_found;
+        total.set_failed += workload_stats[i].set_failed;
+    }
+    for (int op = 0; op < OP_TYPE_NUM; op++) {
+        if (total.ops[op] > 0) {
+            printf("  %s: %lu\n", OP_NAMES[op], total.ops[op]);
+        }
+    }
+    if (total.not_found > 0) {
+        printf("  reads of inserts still in flight: %lu\n", total.not_found);
+    }
+    if (total.set_failed > 0) {
+        printf("  failed writes: %lu\n", total.set_failed);
+    }
+    delete zipf;
+}
+
+/**
+ * Replay mode: the trace is mapped read-only and every thread walks the
+ * block headers, replaying the blocks whose recorded thread maps to it,
+ * so each recorded thread's requests keep their order. Keys are passed
+ * straight from the mapping and values come from buffers allocated once
+ * per thread, so replay does not allocate per request.
+ */
+static const char* trace_base = nullptr;
+static size_t trace_size = 0;
+static uint32_t trace_value_size = 0;      /* buffer size for both Get and Set values */
+static uint64_t replay_start = 0;
+
+static inline void wait_until(uint64_t deadline) {
+    uint64_t now;
+    while ((now = now_ns()) < deadline) {
+        if (deadline - now > 200000) {
+            this_thread::sleep_for(chrono::nanoseconds(deadline - now - 100000));
+        }
+    }
+}
+
+static void* trace_replay(void *id) {
+    long tid = (long) id;
+    local_stat = &thread_stats[tid];
+    vector<char> set_buffer(trace_value_size, 'v');
+    vector<char> get_buffer(trace_value_size);
+    size_t off = sizeof(trace_header);
+    while (off + sizeof(trace_block) <= trace_size) {
+        const trace_block *block = (const trace_block *) (trace_base + off);
+        const trace_record *records = (const trace_record *) (trace_base + off + sizeof(trace_block));
+        off += sizeof(trace_block) + (size_t) block->record_num * sizeof(trace_record);
+        if (off > trace_size) {
+            break;  /* cut short by a crash of the recorder */
+        }
+        if (block->thread % NUM_THREADS != (uint32_t) tid) {
+            continue;
+        }
+        for (uint32_t i = 0; i < block->record_num; i++) {
+            const trace_record &record = records[i];
+            if (REPLAY_SPEED > 0) {
+                wait_until(replay_start + (uint64_t) (record.time_ns / REPLAY_SPEED));
+            }
+            Slice data_key((char *) record.key, KEY_SIZE);
+            uint64_t start = now_ns();
+            if (record.op == TRACE_SET) {
+                db->Set(data_key, Slice(set_buffer.data(), record.value_size));
+                record_latency(LAT_SET, start);
+            } else {
+                Slice data_value(get_buffer.data(), get_buffer.size());
+                db->Get(data_key, &data_value);
+                record_latency(LAT_GET, start);
+            }
+        }
+    }
+    return nullptr;
+}
+
+static void test_replay(pthread_t * tids) {
+    int fd = open(TRACE_PATH.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(trace_header)) {
+        printf("open trace %s failed.\n", TRACE_PATH.c_str());
+        exit(1);
+    }
+    trace_size = st.st_size;
+    trace_base = (const char *) mmap(nullptr, trace_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    const trace_header *header = (const trace_header *) trace_base;
+    if (trace_base == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        printf("%s is not a trace.\n", TRACE_PATH.c_str());
+        exit(1);
+    }
+    madvise((void *) trace_base, trace_size, MADV_SEQUENTIAL);
+    uint64_t record_num = (trace_size - sizeof(trace_header)) / sizeof(trace_record);
+    trace_value_size = max(header->max_value_size, (uint32_t) 1024);
+    printf("replay %s, %s%lu requests, %d threads, %s\n", TRACE_PATH.c_str(),
+           header->record_num == 0 ? "about " : "", header->record_num == 0 ? record_num : header->record_num,
+           NUM_THREADS, REPLAY_SPEED > 0 ? "recorded timing" : "flat out");
+    if (REPLAY_SPEED > 0) {
+        printf("speed x%.2lf\n", REPLAY_SPEED);
+    }
+
+    struct timeval start, end;
+    timeline->set_phase("replay");
+    gettimeofday(&start, nullptr);
+    replay_start = now_ns();
+    run_threads(tids, trace_replay);
+    gettimeofday(&end, nullptr);
+    uint64_t sec_replay = elapsed_us(start, end);
+    uint64_t totals[LAT_TYPE_NUM];
+    sum_ops(totals);
+    printf("Replay: %.2lfms, %.2lf Mops/s\n", sec_replay / 1000.0,
+           (double) (totals[LAT_GET] + totals[LAT_SET]) / max(sec_replay, (uint64_t) 1));
+    report_latency("Replay");
+    munmap((void *) trace_base, trace_size);
+}
+
+/**
+ * Cost of the CRC32C the engine adds to every Set: one 96-byte record
+ * plus its 4-byte header, and the chunk of a value that is not 80 bytes
+ * long. Latency chains every checksum on the previous one. Throughput
+ * checksums STREAMS independent buffers per round, like consecutive Sets
+ * whose checksums overlap with the stores and fences around them.
+ * No DB is opened.
+ */
+static void test_checksum() {
+    const int ROUNDS = 10000000;
+    const int STREAMS = 8;
+    const size_t SIZES[] = {96, 256, 1024};
+    static char data[STREAMS][1024];
+    for (int i = 0; i < STREAMS; i++) {
+        for (size_t j = 0; j < sizeof(data[i]); j++) {
+            data[i][j] = (char) rand();
+        }
+    }
+#if defined(__SSE4_2__)
+    printf("crc32c with the SSE4.2 crc32 instruction, %d rounds\n", ROUNDS);
+#else
+    printf("crc32c with a lookup table (built without SSE4.2), %d rounds\n", ROUNDS);
+#endif
+    for (size_t size : SIZES) {
+        uint32_t crc = 0;
+        uint64_t start = now_ns();
+        for (int round = 0; round < ROUNDS; round++) {
+            memcpy(data[0], &crc, sizeof(crc));
+            crc = crc32c_extend(crc32c(data[0], size), &round, sizeof(round));
+        }
+        double latency = (double) (now_ns() - start) / ROUNDS;
+
+        uint32_t crcs[STREAMS] = {0};
+        start = now_ns();
+        for (int round = 0; round < ROUNDS / STREAMS; round++) {
+            for (int i = 0; i < STREAMS; i++) {
+                crcs[i] ^= crc32c_extend(crc32c(data[i], size), &round, sizeof(round));
+            }
+        }
+        double throughput = (double) (now_ns() - start) / (ROUNDS / STREAMS * STREAMS);
+        for (int i = 0; i < STREAMS; i++) {
+            crc ^= crcs[i];
+        }
+        printf("  %4lu bytes: latency %6.2lf ns, throughput %6.2lf ns per checksum (%08x)\n",
+               size, latency, throughput, crc);
+    }
+}
+
+/**
+ * Options of every DB the judge opens, from the command line.
+ */
+static Options make_options() {
+    Options options;
+    options.cache_size = CACHE_SIZE << 20;
+    options.prefault_threads = PREFAULT_THREADS;
+    options.huge_pages = HUGE_PAGES;
+    options.trace_path = RECORD_PATH;
+    options.durability = DURABILITY.durability;
+    options.group_persist_records = DURABILITY.group_persist_records;
+    options.group_persist_us = DURABILITY.group_persist_us;
+    options.checkpoint_period_sec = CHECKPOINT_SEC;
+    options.async_flushers = ASYNC_FLUSHERS;
+    options.in_place_updates = IN_PLACE;
+    options.layout = LAYOUT;
+    for (int i = 0; i < NUMA_NODES; ++i) {
+        options.numa_paths.push_back("./DB." + to_string(i));
+    }
+    return options;
+}
+
+/**
+ * Opens ./DB (or the -n shard files) into db. Exits if CreateOrOpen
+ * fails, e.g. because an existing file was created with another layout,
+ * instead of running the test on a null db.
+ */
+static void open_db(FILE *log_file, const Options &options) {
+    static const char *const NAMES[] = {"Ok", "NotFound", "IOError", "OutOfMemory"};
+    Status s = DB::CreateOrOpen("./DB", &db, log_file, options);
+    if (s != Ok) {
+        printf("open ./DB failed: %s, see ./performance.log\n", s < 4 ? NAMES[s] : "unknown status");
+        exit(1);
+    }
+}
+
+static uint64_t pair_begin, pair_end;  /* ids written or checked by write_pairs / check_pairs */
+static uint64_t pair_gen;               /* added to the id in every value word */
+static int pair_threads;                /* threads sharing the ids */
+static atomic<uint64_t> pair_bad(0);
+
+static void fill_pair(uint64_t id, uint64_t gen, uint64_t *k, uint64_t *v) {
+    k[0] = id;
+    k[1] = id * BASE;
+    for (int i = 0; i < VALUE_SIZE / 8; i++) {
+        v[i] = id + gen + i;
+    }
+}
+
+static void* write_pairs(void *id) {
+    long tid = (long) id;
+    uint64_t n = pair_end - pair_begin;
+    uint64_t k[KEY_SIZE / 8], v[VALUE_SIZE / 8];
+    for (uint64_t i = pair_begin + n * tid / pair_threads; i < pair_begin + n * (tid + 1) / pair_threads; i++) {
+        fill_pair(i, pair_gen, k, v);
+        if (db->Set(Slice((char *) k, KEY_SIZE), Slice((char *) v, VALUE_SIZE)) != Ok) {
+            pair_bad++;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Ids below pair_begin must hold pair_gen + 1, the rewritten ones.
+ */
+static void* check_pairs(void *id) {
+    long tid = (long) id;
+    uint64_t n = pair_end;
+    uint64_t k[KEY_SIZE / 8], v[VALUE_SIZE / 8], got[VALUE_SIZE / 8];
+    for (uint64_t i = n * tid / pair_threads; i < n * (tid + 1) / pair_threads; i++) {
+        fill_pair(i, i < pair_begin ? pair_gen + 1 : pair_gen, k, v);
+        Slice value((char *) got, VALUE_SIZE);
+        if (db->Get(Slice((char *) k, KEY_SIZE), &value) != Ok || memcmp(got, v, VALUE_SIZE) != 0) {
+            pair_bad++;
+        }
+    }
+    return nullptr;
+}
+
+static void remove_db() {
+    unlink("./DB");
+    for (int i = 0; i < NUMA_NODES; ++i) {
+        unlink(("./DB." + to_string(i)).c_str());
+    }
+}
+
+/**
+ * Open time after a crash for a DB of keys records. A child process
+ * loads them, closes the DB cleanly, reopens it, rewrites the first
+ * 1/16 of the keys and exits without closing. The parent then times
+ * the open and checks every key. Returns the open time in us, or 0 if
+ * a key was lost.
+ */
+static uint64_t restart_once(uint64_t keys, uint32_t checkpoint_sec, pthread_t *tids) {
+    Options options = make_options();
+    options.checkpoint_period_sec = checkpoint_sec;
+    options.trace_path.clear();
+    remove_db();
+    pair_threads = NUM_THREADS;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        FILE *log_file = fopen("./performance.log", "a");
+        open_db(log_file, options);
+        pair_begin = 0, pair_end = keys, pair_gen = 0;
+        run_threads(tids, write_pairs);
+        delete db;
+        log_file = fopen("./performance.log", "a");
+        open_db(log_file, options);
+        pair_end = keys / 16, pair_gen = 1;
+        run_threads(tids, write_pairs);
+        _exit(pair_bad.load() == 0 ? 0 : 1);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("restart: loading %lu keys failed\n", keys);
+        return 0;
+    }
+    FILE *log_file = fopen("./performance.log", "a");
+    uint64_t start = now_ns();
+    open_db(log_file, options);
+    uint64_t open_us = (now_ns() - start) / 1000;
+    pair_begin = keys / 16, pair_end = keys, pair_gen = 0, pair_bad = 0;
+    run_threads(tids, check_pairs);
+    delete db;
+    remove_db();
+    if (pair_bad.load() != 0) {
+        printf("restart: %lu of %lu keys lost or wrong\n", pair_bad.load(), keys);
+        return 0;
+    }
+    return open_us;
+}
+
+/**
+ * Restart time against database size: the open after a crash with a
+ * full scan of the logs and with the index checkpoints taken on the
+ * last clean close, for 1/8, 1/4, 1/2 and all of -k keys. -C sets the
+ * checkpoint period of the second run; by default it is long enough
+ * that only the checkpoint of the close is taken.
+ */
+static void test_restart() {
+    vector<pthread_t> tids(NUM_THREADS);
+    uint32_t period = CHECKPOINT_SEC > 0 ? CHECKPOINT_SEC : 3600;
+    printf("restart after a crash, 1/16 of the keys rewritten since the last close, %d threads\n", NUM_THREADS);
+    printf("%12s %10s %14s %14s\n", "keys", "data(MB)", "full scan(ms)", "checkpoint(ms)");
+    for (int shift = 3; shift >= 0; shift--) {
+        uint64_t keys = max(KEY_SPACE >> shift, (uint64_t) 16);
+        uint64_t scan_us = restart_once(keys, 0, tids.data());
+        uint64_t checkpoint_us = restart_once(keys, period, tids.data());
+        printf("%12lu %10.1lf %14.2lf %14.2lf\n", keys, (double) keys * (KEY_SIZE + VALUE_SIZE) / (1 << 20),
+               scan_us / 1000.0, checkpoint_us / 1000.0);
+    }
+}
+
+/**
+ * Loads -k keys into a fresh DB with writers threads and checks them.
+ * Returns the Mops/s of the Sets alone (accept) and of the Sets plus
+ * the close, which waits for queued pairs to reach the media (durable).
+ */
+static bool write_once(int writers, uint32_t flushers, pthread_t *tids, double *accept, double *durable) {
+    Options options = make_options();
+    options.async_flushers = flushers;
+    options.trace_path.clear();
+    remove_db();
+    open_db(fopen("./performance.log", "a"), options);
+    pair_begin = 0, pair_end = KEY_SPACE, pair_gen = 0, pair_threads = writers, pair_bad = 0;
+    uint64_t start = now_ns();
+    run_threads(tids, write_pairs, writers);
+    uint64_t written = now_ns();
+    delete db;
+    uint64_t closed = now_ns();
+    *accept = KEY_SPACE * 1000.0 / max(written - start, (uint64_t) 1);
+    *durable = KEY_SPACE * 1000.0 / max(closed - start, (uint64_t) 1);
+
+    open_db(fopen("./performance.log", "a"), make_options());
+    pair_threads = NUM_THREADS;
+    run_threads(tids, check_pairs);
+    delete db;
+    remove_db();
+    if (pair_bad.load() != 0) {
+        printf("writers: %lu of %lu keys lost or wrong\n", pair_bad.load(), (uint64_t) KEY_SPACE);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Write bandwidth against the number of threads writing the media.
+ * First 1, 2, 4, ... -t threads call Set directly and the best count is
+ * reported. Then -t client threads queue their Sets to 1, 2, 4, ...
+ * flusher threads (Options::async_flushers), so only the flushers
+ * write the media.
+ */
+static void test_writers() {
+    vector<pthread_t> tids(NUM_THREADS);
+    printf("%lu keys per run, Mops/s of the Sets (accept) and of the Sets plus close (durable)\n", KEY_SPACE);
+    printf("synchronous Set\n%10s %10s %10s\n", "writers", "accept", "durable");
+    int best = 0;
+    double best_mops = 0;
+    for (int writers = 1; ; writers = min(writers * 2, NUM_THREADS)) {
+        double accept, durable;
+        if (!write_once(writers, 0, tids.data(), &accept, &durable)) {
+            return;
+        }
+        printf("%10d %10.2lf %10.2lf\n", writers, accept, durable);
+        if (durable > best_mops) {
+            best = writers;
+            best_mops = durable;
+        }
+        if (writers == NUM_THREADS) {
+            break;
+        }
+    }
+    printf("best: %d writers, %.2lf Mops/s\n", best, best_mops);
+
+    printf("asynchronous Set, %d clients\n%10s %10s %10s\n", NUM_THREADS, "flushers", "accept", "durable");
+    for (int flushers = 1; ; flushers = min(flushers * 2, NUM_THREADS)) {
+        double accept, durable;
+        if (!write_once(NUM_THREADS, flushers, tids.data(), &accept, &durable)) {
+            return;
+        }
+        printf("%10d %10.2lf %10.2lf\n", flushers, accept, durable);
+        if (flushers == NUM_THREADS) {
+            break;
+        }
+    }
+}
+
+/**
+ * One row of test_layouts: -k keys loaded into a fresh DB with -t
+ * writers, all of them overwritten, read back, then the DB is closed
+ * and reopened and every key checked again. Returns false if a key was
+ * lost or wrong.
+ */
+static bool layout_once(Layout layout, pthread_t *tids) {
+    Options options = make_options();
+    options.layout = layout;
+    options.trace_path.clear();
+    remove_db();
+    open_db(fopen("./performance.log", "a"), options);
+    pair_threads = NUM_THREADS, pair_bad = 0;
+    uint64_t t0 = now_ns();
+    pair_begin = 0, pair_end = KEY_SPACE, pair_gen = 0;
+    run_threads(tids, write_pairs);
+    uint64_t t1 = now_ns();
+    pair_gen = 1;
+    run_threads(tids, write_pairs);
+    uint64_t t2 = now_ns();
+    pair_begin = KEY_SPACE, pair_gen = 0;
+    run_threads(tids, check_pairs);
+    uint64_t t3 = now_ns();
+    std::string user_bytes, media_bytes;
+    double amplification = 0;
+    if (db->GetProperty("nvm.user-bytes", &user_bytes) && db->GetProperty("nvm.media-bytes", &media_bytes)) {
+        uint64_t user = strtoull(user_bytes.c_str(), nullptr, 10);
+        amplification = user ? (double) strtoull(media_bytes.c_str(), nullptr, 10) / user : 0.0;
+    }
+    delete db;
+    uint64_t t4 = now_ns();
+    open_db(fopen("./performance.log", "a"), options);
+    uint64_t t5 = now_ns();
+    run_threads(tids, check_pairs);
+    delete db;
+    remove_db();
+    printf("%8s %10.2lf %10.2lf %10.2lf %10.2lf %10.2lf %10.2lf\n", layout == LayoutThread ? "thread" : "bucket",
+           KEY_SPACE * 1000.0 / max(t1 - t0, (uint64_t) 1), KEY_SPACE * 1000.0 / max(t2 - t1, (uint64_t) 1),
+           KEY_SPACE * 1000.0 / max(t3 - t2, (uint64_t) 1), amplification, (t4 - t3) / 1e6, (t5 - t4) / 1e6);
+    if (pair_bad.load() != 0) {
+        printf("layouts: %lu of %lu keys lost or wrong\n", pair_bad.load(), (uint64_t) KEY_SPACE);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The bucket layout (1024 hashed logs) against the thread layout (one
+ * sequential log per writer thread) on the same keys: Mops/s of the
+ * load, the overwrite and the reads, write amplification, and the time
+ * of the close and of the reopen, which scans the logs.
+ */
+static void test_layouts() {
+    vector<pthread_t> tids(NUM_THREADS);
+    printf("%lu keys, %d threads, Mops/s of each phase\n", KEY_SPACE, NUM_THREADS);
+    printf("%8s %10s %10s %10s %10s %10s %10s\n", "layout", "load", "overwrite", "read", "write amp", "close(ms)",
+           "open(ms)");
+    if (layout_once(LayoutBucket, tids.data())) {
+        layout_once(LayoutThread, tids.data());
+    }
+}
+
 int main(int argc, char *argv[]) {
 
     printf("start judge...\n");
 
     config_parse(argc, argv);
+    if (MODE == 4) {
+        test_checksum();
+        return 0;
+    }
+    if (MODE == 5) {
+        test_restart();
+        return 0;
+    }
+    if (MODE == 6) {
+        test_writers();
+        return 0;
+    }
+    if (MODE == 7) {
+        test_layouts();
+        return 0;
+    }
     init_pool_seed();
     FILE * log_file =  fopen("./performance.log", "w");
-    pthread_t tids[NUM_THREADS];
+    vector<pthread_t> tids(NUM_THREADS);
+    if (MODE == 1) {
+        key_pool = new uint64_t[KEY_SPACE * 2];
+        val_pool = new uint64_t[KEY_SPACE * 10];
+    }
 
+    timeline = new Timeline(TIMELINE_PATH.c_str(), LAT_TYPE_NUM, LAT_NAMES, sum_ops);
+    timeline->set_phase("open");
     gettimeofday(&TIME_START,nullptr);
-    DB::CreateOrOpen("./DB", &db, log_file);
-    test_set_pure(tids);    /* Test Set */
+    Options options = make_options();
+    open_db(log_file, options);
+    struct timeval time_open;
+    gettimeofday(&time_open,nullptr);
+    uint64_t sec_open = 1000000 * (time_open.tv_sec-TIME_START.tv_sec)+ (time_open.tv_usec-TIME_START.tv_usec);
+    if (MODE == 2 || MODE == 3) {
+        printf("Open: %.2lfms\n", sec_open/1000.0);
+        if (MODE == 2) {
+            test_workload(tids.data());
+        } else {
+            test_replay(tids.data());
+        }
+        delete timeline;
+        report_engine_stats();
+        delete db;
+        return 0;
+    }
+    timeline->set_phase("set");
+    test_set_pure(tids.data());    /* Test Set */
     gettimeofday(&TIME_END,nullptr);
     uint64_t sec_set = 1000000 * (TIME_END.tv_sec-TIME_START.tv_sec)+ (TIME_END.tv_usec-TIME_START.tv_usec);
-    test_set_get(tids);     /* Test Set & Get */
+    uint64_t sec_set_pure = sec_set - sec_open;
+    report_latency("Set");
+    timeline->set_phase("get_set");
+    test_set_get(tids.data());     /* Test Set & Get */
     gettimeofday(&TIME_END,nullptr);
+    report_latency("Get & Set");
+    delete timeline;
 
     uint64_t sec_total = 1000000 * (TIME_END.tv_sec-TIME_START.tv_sec)+ (TIME_END.tv_usec-TIME_START.tv_usec);
     uint64_t sec_set_get = sec_total - sec_set;
-    printf("Set: %.2lfms\n"
-           "Get & Set: %.2lfms\n", sec_set/1000.0, sec_set_get/1000.0);
+    printf("Open: %.2lfms\n"
+           "Set: %.2lfms\n"
+           "Get & Set: %.2lfms\n", sec_open/1000.0, sec_set/1000.0, sec_set_get/1000.0);
+    printf("Set throughput: %.2lf Mops/s (excluding open)\n",
+           (double) PER_SET * NUM_THREADS / max(sec_set_pure, (uint64_t) 1));
+    report_engine_stats();
 
     delete db;  /* Release */
     return 0;
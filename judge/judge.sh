@@ -6,7 +6,7 @@ set_per_thread=$2
 get_per_thread=$3
 
 
-g++ -pthread -o judge judge.cpp random.cpp\
+g++ -pthread -o judge judge.cpp random.cpp workload.cpp latency.cpp\
 	-L $LIB_PATH -lengine -lpmem\
 	-I $INCLUDE_DIR \
   -g \
@@ -0,0 +1,99 @@
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include "latency.h"
+
+LatencyHistogram::LatencyHistogram() : count_(0), max_(0) {
+    memset(counts_, 0, sizeof(counts_));
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (int i = 0; i < BUCKET_NUM; i++) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    if (other.max_ > max_) {
+        max_ = other.max_;
+    }
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t) ceil(q * count_);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKET_NUM; i++) {
+        seen += counts_[i];
+        if (seen >= target) {
+            uint64_t value = highest_equivalent(i);
+            return value < max_ ? value : max_;
+        }
+    }
+    return max_;
+}
+
+uint64_t LatencyHistogram::highest_equivalent(int index) {
+    if (index < SUB_COUNT) {
+        return index;
+    }
+    int shift = index / SUB_COUNT - 1;
+    uint64_t sub = index % SUB_COUNT;
+    return ((SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+
+Timeline::Timeline(const char *path, int type_num, const char *const *type_names,
+                   const std::function<void(uint64_t *totals)> &sum)
+        : file_(fopen(path, "w")), type_num_(type_num < MAX_TYPE_NUM ? type_num : MAX_TYPE_NUM), sum_(sum),
+          phase_(""), stop_(false) {
+    if (file_ == nullptr) {
+        perror("open timeline failed");
+        return;
+    }
+    fprintf(file_, "second,phase");
+    for (int i = 0; i < type_num_; i++) {
+        fprintf(file_, ",%s", type_names[i]);
+    }
+    fprintf(file_, "\n");
+    sampler_ = std::thread(&Timeline::run, this);
+}
+
+Timeline::~Timeline() {
+    stop();
+}
+
+void Timeline::stop() {
+    if (sampler_.joinable()) {
+        stop_.store(true);
+        sampler_.join();
+    }
+    if (file_ != nullptr) {
+        fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+/**
+ * Wakes up on whole-second boundaries from the start, so a late wakeup
+ * shortens the next interval instead of drifting the rows.
+ */
+void Timeline::run() {
+    uint64_t last[MAX_TYPE_NUM] = {0};
+    uint64_t totals[MAX_TYPE_NUM];
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t second = 1; !stop_.load(); second++) {
+        auto deadline = start + std::chrono::seconds(second);
+        while (!stop_.load() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        sum_(totals);
+        fprintf(file_, "%lu,%s", second, phase_.load(std::memory_order_relaxed));
+        for (int i = 0; i < type_num_; i++) {
+            fprintf(file_, ",%lu", totals[i] - last[i]);
+            last[i] = totals[i];
+        }
+        fprintf(file_, "\n");
+        fflush(file_);
+    }
+}
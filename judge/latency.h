@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+/**
+ * HDR-style latency histogram: values below 2^SUB_BITS are counted
+ * exactly, above that every power of two is split into 2^SUB_BITS linear
+ * buckets, so the relative error stays under 1 / 2^SUB_BITS (about 3%).
+ * Each thread owns its histograms and records without synchronization;
+ * they are merged after the threads are joined.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t value) {
+        counts_[index(value)]++;
+        count_++;
+        if (value > max_) {
+            max_ = value;
+        }
+    }
+
+    void merge(const LatencyHistogram &other);
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    /**
+     * Highest value equivalent to the one at quantile q (0 < q <= 1).
+     */
+    uint64_t percentile(double q) const;
+
+private:
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKET_NUM = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    static int index(uint64_t value) {
+        if (value < (uint64_t) SUB_COUNT) {
+            return (int) value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (int) ((value >> shift) - SUB_COUNT);
+    }
+
+    static uint64_t highest_equivalent(int index);
+
+    uint64_t counts_[BUCKET_NUM];
+    uint64_t count_;
+    uint64_t max_;
+};
+
+/**
+ * Writes one CSV row per second with the number of requests of each type
+ * completed in that second. sum fills the running totals of every type,
+ * the rows hold the differences between consecutive samples.
+ */
+class Timeline {
+public:
+    Timeline(const char *path, int type_num, const char *const *type_names,
+             const std::function<void(uint64_t *totals)> &sum);
+
+    ~Timeline();
+
+    void set_phase(const char *phase) {
+        phase_.store(phase, std::memory_order_relaxed);
+    }
+
+    void stop();
+
+private:
+    void run();
+
+    static const int MAX_TYPE_NUM = 8;
+
+    FILE *file_;
+    int type_num_;
+    std::function<void(uint64_t *totals)> sum_;
+    std::atomic<const char *> phase_;
+    std::atomic<bool> stop_;
+    std::thread sampler_;
+};
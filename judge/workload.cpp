@@ -0,0 +1,140 @@
+#include <cmath>
+#include <cstring>
+#include "workload.h"
+
+static const int VALUE_SIZE = 80;
+
+const char *OP_NAMES[OP_TYPE_NUM] = {"read", "update", "insert", "scan", "rmw"};
+
+/*                                  read update insert scan rmw */
+static const Workload WORKLOADS[] = {
+        {"a", {50,  50,     0,    0,  0},  DIST_ZIPFIAN},   /* update heavy */
+        {"b", {95,  5,      0,    0,  0},  DIST_ZIPFIAN},   /* read mostly */
+        {"c", {100, 0,      0,    0,  0},  DIST_ZIPFIAN},   /* read only */
+        {"d", {95,  0,      5,    0,  0},  DIST_LATEST},    /* read latest */
+        {"e", {0,   0,      5,    95, 0},  DIST_ZIPFIAN},   /* short ranges */
+        {"f", {50,  0,      0,    0,  50}, DIST_ZIPFIAN},   /* read-modify-write */
+};
+
+bool find_workload(const std::string &name, Workload *workload) {
+    for (const Workload &w : WORKLOADS) {
+        if (name == w.name) {
+            *workload = w;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_dist(const std::string &name, KeyDist *dist) {
+    if (name == "uniform") {
+        *dist = DIST_UNIFORM;
+    } else if (name == "zipfian") {
+        *dist = DIST_ZIPFIAN;
+    } else if (name == "latest") {
+        *dist = DIST_LATEST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *dist_name(KeyDist dist) {
+    switch (dist) {
+        case DIST_UNIFORM:
+            return "uniform";
+        case DIST_ZIPFIAN:
+            return "zipfian";
+        default:
+            return "latest";
+    }
+}
+
+
+ZipfianGenerator::ZipfianGenerator(uint64_t items, double theta) : items_(items), theta_(theta) {
+    double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+    zetan_ = 0;
+    for (uint64_t i = 1; i <= items; ++i) {
+        zetan_ += 1.0 / pow((double) i, theta);
+    }
+    alpha_ = 1.0 / (1.0 - theta);
+    eta_ = (1.0 - pow(2.0 / items, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+}
+
+uint64_t ZipfianGenerator::next(std::mt19937_64 &rng) const {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    double uz = u * zetan_;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, theta_)) {
+        return 1;
+    }
+    uint64_t item = (uint64_t) (items_ * pow(eta_ * u - eta_ + 1.0, alpha_));
+    return item < items_ ? item : items_ - 1;
+}
+
+
+KeyChooser::KeyChooser(KeyDist dist, const ZipfianGenerator *zipf, const std::atomic<uint64_t> *inserted)
+        : dist_(dist), zipf_(zipf), inserted_(inserted) {}
+
+uint64_t KeyChooser::next(std::mt19937_64 &rng) const {
+    uint64_t count = inserted_->load(std::memory_order_relaxed);
+    switch (dist_) {
+        case DIST_UNIFORM:
+            return std::uniform_int_distribution<uint64_t>(0, count - 1)(rng);
+        case DIST_ZIPFIAN:
+            return zipf_->next(rng) % count;
+        default: {
+            uint64_t distance = zipf_->next(rng);
+            return distance < count ? count - 1 - distance : 0;
+        }
+    }
+}
+
+
+OpType next_op(const Workload &workload, std::mt19937_64 &rng) {
+    int r = (int) (rng() % 100);
+    for (int op = 0; op < OP_TYPE_NUM; ++op) {
+        if (r < workload.ratio[op]) {
+            return (OpType) op;
+        }
+        r -= workload.ratio[op];
+    }
+    return OP_READ;
+}
+
+
+/**
+ * splitmix64 finalizer, spreads consecutive ids over the whole key space.
+ */
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+void make_key(uint64_t id, char *key) {
+    uint64_t a = mix(id);
+    uint64_t b = mix(id ^ 0x9e3779b97f4a7c15ull);
+    memcpy(key, &a, sizeof(a));
+    memcpy(key + sizeof(a), &b, sizeof(b));
+}
+
+void make_value(uint64_t id, uint64_t version, const unsigned int *filler, char *value) {
+    memcpy(value, &id, sizeof(id));
+    memcpy(value + sizeof(id), &version, sizeof(version));
+    memcpy(value + 2 * sizeof(uint64_t), filler, VALUE_SIZE - 2 * sizeof(uint64_t));
+}
+
+uint64_t value_version(const char *value) {
+    uint64_t version;
+    memcpy(&version, value + sizeof(uint64_t), sizeof(version));
+    return version;
+}
+
+bool check_value(uint64_t id, const char *value) {
+    uint64_t stored;
+    memcpy(&stored, value, sizeof(stored));
+    return stored == id;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <random>
+#include <string>
+
+/**
+ * YCSB style workloads for the judge.
+ *
+ * Records are identified by a 64-bit id. The 16-byte key is a mix of the id
+ * and the first 16 bytes of every value carry the id and a version, so a
+ * read can be checked against the key it was issued for without tracking
+ * the last written value.
+ */
+
+enum OpType {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,        /* consecutive ids read with one MultiGet, the engine has no ordered scan */
+    OP_RMW,         /* read-modify-write */
+    OP_TYPE_NUM
+};
+
+enum KeyDist {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_LATEST     /* zipfian over the distance from the newest insert */
+};
+
+struct Workload {
+    const char *name;
+    int ratio[OP_TYPE_NUM];     /* percent of each op type */
+    KeyDist dist;
+};
+
+static const int MAX_SCAN_LENGTH = 64;
+
+extern const char *OP_NAMES[OP_TYPE_NUM];
+
+/**
+ * Workloads a-f with the YCSB core mixes, false for an unknown name.
+ */
+bool find_workload(const std::string &name, Workload *workload);
+
+/**
+ * "uniform", "zipfian" or "latest", false for an unknown name.
+ */
+bool parse_dist(const std::string &name, KeyDist *dist);
+
+const char *dist_name(KeyDist dist);
+
+/**
+ * Gray et al. zipfian generator as used by YCSB, item 0 is the hottest.
+ * The constants are computed once, next() is thread-safe.
+ */
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t items, double theta = 0.99);
+
+    uint64_t next(std::mt19937_64 &rng) const;
+
+private:
+    uint64_t items_;
+    double theta_;
+    double alpha_;
+    double zetan_;
+    double eta_;
+};
+
+/**
+ * Picks the id of an existing record. inserted is the number of ids handed
+ * out so far, records beyond the loaded ones are inserted by the run phase.
+ */
+class KeyChooser {
+public:
+    KeyChooser(KeyDist dist, const ZipfianGenerator *zipf, const std::atomic<uint64_t> *inserted);
+
+    uint64_t next(std::mt19937_64 &rng) const;
+
+private:
+    KeyDist dist_;
+    const ZipfianGenerator *zipf_;
+    const std::atomic<uint64_t> *inserted_;
+};
+
+/**
+ * Picks the op type of the next request according to the workload ratio.
+ */
+OpType next_op(const Workload &workload, std::mt19937_64 &rng);
+
+void make_key(uint64_t id, char *key);
+
+/**
+ * 80-byte value of record id: id, version, then filler.
+ */
+void make_value(uint64_t id, uint64_t version, const unsigned int *filler, char *value);
+
+uint64_t value_version(const char *value);
+
+/**
+ * Whether value was written for record id.
+ */
+bool check_value(uint64_t id, const char *value);
@@ -0,0 +1,186 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/17
+ * @project: tair-contest
+ * @desp: C++20 无栈协程交错执行多个查找：每个查找预取下一步要访问的地址后挂起，
+ *        调度器轮流恢复，多个查找的 cache miss 互相重叠
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_COROUTINE_H_
+#define TAIR_CONTEST_KV_CONTEST_COROUTINE_H_
+
+#include "Statement.hpp"
+
+#ifdef USE_COROUTINE
+
+#include <coroutine>
+#include <cstdlib>
+#include <exception>
+#include <new>
+
+/**
+ * 协程帧的线程内空闲链表。同时存活的帧不超过调度窗口，用完放回链表，
+ * 稳定运行后查找路径上不再分配内存；超过 SIZE 的帧直接走 operator new
+ */
+struct frame_pool {
+    const static size_t SIZE = 512;
+
+    struct node {
+        node *next;
+    };
+    node *free_list = nullptr;
+
+    ~frame_pool() {
+        while (free_list) {
+            node *n = free_list;
+            free_list = n->next;
+            ::operator delete(n);
+        }
+    }
+
+    static frame_pool &Local() {
+        static thread_local frame_pool pool;
+        return pool;
+    }
+
+    void *Alloc(size_t size) {
+        if (size > SIZE) {
+            return ::operator new(size);
+        }
+        if (free_list) {
+            node *n = free_list;
+            free_list = n->next;
+            return n;
+        }
+        return ::operator new(SIZE);
+    }
+
+    void Free(void *p, size_t size) {
+        if (size > SIZE) {
+            ::operator delete(p);
+            return;
+        }
+        node *n = (node *) p;
+        n->next = free_list;
+        free_list = n;
+    }
+};
+
+
+/**
+ * 查找协程的返回类型：创建后先挂起，由 lookup_window 恢复；结束时也挂起，由 lookup_window 销毁
+ */
+struct lookup_task {
+    struct promise_type {
+        lookup_task get_return_object() {
+            return lookup_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t size) { return frame_pool::Local().Alloc(size); }
+
+        static void operator delete(void *p, size_t size) { frame_pool::Local().Free(p, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+/**
+ * co_await Prefetch(addr)：发出预取后挂起，数据在路上时调度器去推进其他查找
+ */
+struct prefetch_awaiter {
+    const void *addr;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<>) const noexcept { __builtin_prefetch(addr); }
+
+    void await_resume() const noexcept {}
+};
+
+inline prefetch_awaiter Prefetch(const void *addr) {
+    return prefetch_awaiter{addr};
+}
+
+
+/**
+ * 在途查找的窗口，最多 WIDTH 个，按进入的先后排成环。Push 先把新查找推进到第一个挂起点（发出第一个预取）
+ * 再放到队尾，窗口满时从队头开始轮流恢复，直到有一个结束空出位置；Drain 把在途的查找全部推进到结束。
+ * 每个查找两次恢复之间隔着其他全部在途查找，预取的数据有时间到达
+ */
+template<size_t WIDTH>
+struct lookup_window {
+    std::coroutine_handle<> running[WIDTH];
+    size_t head = 0;
+    size_t active = 0;
+
+    void Push(std::coroutine_handle<> handle) {
+        while (active == WIDTH) {
+            Step();
+        }
+        handle.resume();
+        if (handle.done()) {
+            handle.destroy();
+            return;
+        }
+        running[(head + active++) % WIDTH] = handle;
+    }
+
+    void Drain() {
+        while (active > 0) {
+            Step();
+        }
+    }
+
+    /**
+     * 丢弃在途的查找，不再恢复
+     */
+    void Clear() {
+        while (active > 0) {
+            running[head].destroy();
+            head = (head + 1) % WIDTH;
+            --active;
+        }
+    }
+
+    /**
+     * 恢复队头的查找，没有结束就放回队尾
+     */
+    void Step() {
+        std::coroutine_handle<> handle = running[head];
+        head = (head + 1) % WIDTH;
+        --active;
+        handle.resume();
+        if (handle.done()) {
+            handle.destroy();
+        } else {
+            running[(head + active++) % WIDTH] = handle;
+        }
+    }
+};
+
+
+/**
+ * 调度器：依次用 spawn(i) 创建 n 个查找协程，最多 WIDTH 个同时在途，
+ * 某个结束后立即用下一个查找补上它的位置
+ */
+template<size_t WIDTH, typename Spawn>
+inline void Interleave(size_t n, Spawn &&spawn) {
+    lookup_window<WIDTH> window;
+    for (size_t i = 0; i < n; ++i) {
+        window.Push(spawn(i).handle);
+    }
+    window.Drain();
+}
+
+#endif
+
+#endif
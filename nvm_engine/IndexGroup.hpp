@@ -0,0 +1,59 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/20
+ * @project: tair-contest
+ * @desp: DRAM 索引的组结构，一组正好一个 cache line，用 SIMD 一次比较组内全部 tag
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_INDEX_GROUP_H_
+#define TAIR_CONTEST_KV_CONTEST_INDEX_GROUP_H_
+
+#include <cstdint>
+#include <immintrin.h>
+
+const static uint32_t GROUP_SLOT_NUM = 12;
+
+
+/**
+ * 12 个 1 字节 tag + 溢出位图 + 12 个 4 字节索引项，共 64 字节。
+ * tag 最高位为 1 表示已占用，0 表示空；索引项为 0 表示空。
+ * 插入时先 CAS 索引项占住槽位，再写 tag，所以判断组内是否还有空位以索引项为准。
+ * overflow 的第 i 位为 1 表示第 i 个槽的 key 不在自己的起始组（本组满了才探测到这里），
+ * 索引检查点据此判断哪些项在恢复时可以原样放回
+ */
+struct index_group {
+    uint8_t tags[GROUP_SLOT_NUM];
+    uint32_t overflow;                  //  紧跟 tags，tags 可以 16 字节整体加载
+    uint32_t entries[GROUP_SLOT_NUM];
+} __attribute__((aligned(64)));
+
+
+/**
+ * 组内 tag 等于 tag 的槽位掩码，第 i 位对应第 i 个槽
+ */
+inline uint32_t MatchTag(const index_group &group, uint8_t tag) {
+    __m128i tags = _mm_load_si128((const __m128i *) group.tags);
+    __m128i eq = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char) tag));
+    return (uint32_t) _mm_movemask_epi8(eq) & ((1u << GROUP_SLOT_NUM) - 1);
+}
+
+
+/**
+ * 组内是否还有空的索引项
+ */
+inline bool HasEmpty(const index_group &group) {
+#if defined(__AVX2__)
+    __m256i lo = _mm256_loadu_si256((const __m256i *) group.entries);
+    __m128i hi = _mm_load_si128((const __m128i *) (group.entries + 8));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi32(lo, _mm256_setzero_si256())) != 0 ||
+           _mm_movemask_epi8(_mm_cmpeq_epi32(hi, _mm_setzero_si128())) != 0;
+#else
+    __m128i zero = _mm_setzero_si128();
+    __m128i e0 = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *) group.entries), zero);
+    __m128i e1 = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *) (group.entries + 4)), zero);
+    __m128i e2 = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *) (group.entries + 8)), zero);
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(e0, e1), e2)) != 0;
+#endif
+}
+
+#endif
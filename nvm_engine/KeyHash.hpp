@@ -0,0 +1,39 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/21
+ * @project: tair-contest
+ * @desp: 16 字节定长 key 的哈希，直接读 key 的两个 8 字节字，不构造 std::string
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_KEY_HASH_H_
+#define TAIR_CONTEST_KV_CONTEST_KEY_HASH_H_
+
+#include <cstdint>
+#include <cstring>
+
+const static uint64_t HASH_P0 = 0xa0761d6478bd642full;
+const static uint64_t HASH_P1 = 0xe7037ed1a0b428dbull;
+const static uint64_t HASH_SEED = 0x8ebc6af09c88c6e3ull;
+
+
+/**
+ * 64 x 64 -> 128 位乘法，高低两半异或
+ */
+inline uint64_t HashMix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+
+/**
+ * wyhash 对 16 字节输入的计算方式，64 位输出的每一位都充分混合，
+ * 选桶、选索引组和 tag 可以从同一个 hash 的不同位段取
+ */
+inline uint64_t KeyHash(const char *key) {
+    uint64_t a, b;
+    memcpy(&a, key, sizeof(uint64_t));
+    memcpy(&b, key + sizeof(uint64_t), sizeof(uint64_t));
+    return HashMix(HASH_P1 ^ 16, HashMix(a ^ HASH_P1, b ^ HASH_SEED ^ HASH_P0));
+}
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/22
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include "NumaEngine.hpp"
+
+#define UNLIKELY(x) (__builtin_expect((x), 0))
+
+
+NumaEngine::NumaEngine(const std::vector<std::string> &paths, FILE *log_file, const Options &options)
+        : shards_(paths.size(), nullptr), next_node_(0), async_(options.async_flushers > 0), log_file_(log_file) {
+    if (paths.size() > MAX_SHARD_NUM) {
+        PrintLog("[NumaEngine::NumaEngine] at most %lu shards are supported\n", MAX_SHARD_NUM);
+        exit(1);
+    }
+
+    bool emulated = false;
+    cpus_ = NodeCpus(paths.size(), &emulated);
+    PrintLog("[NumaEngine::NumaEngine] %lu shards on %s NUMA topology\n", paths.size(),
+             emulated ? "emulated" : "real");
+
+    //  各分片并行打开（包括恢复），创建线程先绑定到所在节点的 CPU
+    std::vector<std::thread> openers;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        openers.emplace_back([this, &paths, &options, log_file, i]() {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus_[i]) {
+                CPU_SET(cpu, &set);
+            }
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            shards_[i] = new NvmEngine(paths[i], log_file, options, (int) i);
+        });
+    }
+    for (auto &opener : openers) {
+        opener.join();
+    }
+}
+
+
+Status NumaEngine::CreateOrOpen(const std::vector<std::string> &paths, DB **dbptr, FILE *log_file,
+                                const Options &options) {
+    //  先确认所有分片文件，避免打开一部分之后才发现某个分片的布局不对
+    for (auto &path : paths) {
+        Status status = NvmEngine::CheckLayout(path, log_file);
+        if (status != Ok) {
+            return status;
+        }
+    }
+    NumaEngine *db = new NumaEngine(paths, log_file, options);
+    *dbptr = db;
+    return Ok;
+}
+
+
+/**
+ * 读取 /sys 下各节点的 CPU 列表；节点数不足时把当前进程可用的 CPU 均分成 node_num 份来模拟，
+ * CPU 比节点少时多个模拟节点共用 CPU
+ */
+std::vector<std::vector<int>> NumaEngine::NodeCpus(size_t node_num, bool *emulated) {
+    std::vector<std::vector<int>> nodes;
+    for (size_t node = 0; node < node_num; ++node) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!in || !std::getline(in, list) || ParseCpuList(list).empty()) {
+            break;
+        }
+        nodes.push_back(ParseCpuList(list));
+    }
+    *emulated = nodes.size() < node_num;
+    if (!*emulated) {
+        return nodes;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    std::vector<int> all;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            all.push_back(cpu);
+        }
+    }
+
+    nodes.assign(node_num, std::vector<int>());
+    if (all.size() < node_num) {
+        for (size_t node = 0; node < node_num; ++node) {
+            nodes[node].push_back(all[node % all.size()]);
+        }
+    } else {
+        for (size_t i = 0; i < all.size(); ++i) {
+            nodes[i * node_num / all.size()].push_back(all[i]);
+        }
+    }
+    return nodes;
+}
+
+
+/**
+ * 解析 "0-3,8-11" 格式的 CPU 列表
+ */
+std::vector<int> NumaEngine::ParseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first, last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1) {
+            continue;
+        }
+        if (n == 1) {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+
+/**
+ * 用 hash 中分片内没有用到的第 49 ~ 52 位选分片：分片内第 0 ~ 9 位选桶，第 10 ~ 41 位选索引组，
+ * 第 42 ~ 48 位是索引组中的 tag 字节，第 53 ~ 63 位是索引项中的 tag，所以分片内桶和索引组的分布不受影响
+ */
+inline size_t NumaEngine::ShardIndex(const Slice &key) const {
+    return ((KeyHash(key.data()) >> 49) & 0xf) % shards_.size();
+}
+
+
+/**
+ * 调用线程所在节点的分片，线程第一次访问时确定（见 BindThread）
+ */
+inline size_t NumaEngine::LocalShard() {
+    thread_local const NumaEngine *bound = nullptr;
+    thread_local size_t node = 0;
+    if (UNLIKELY(bound != this || node >= shards_.size())) {
+        node = BindThread();
+        bound = this;
+    }
+    return node;
+}
+
+
+/**
+ * 线程已经绑定在某一个节点的 CPU 内时就用这个节点，否则按到达顺序轮流绑定到各节点的 CPU。
+ * 模拟拓扑中 CPU 比节点少时多个节点共用 CPU，线程的 CPU 同时属于几个节点也按未绑定处理
+ */
+size_t NumaEngine::BindThread() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+    size_t bound = NO_SHARD;
+    for (size_t node = 0; node < cpus_.size(); ++node) {
+        cpu_set_t local;
+        CPU_ZERO(&local);
+        for (int cpu : cpus_[node]) {
+            CPU_SET(cpu, &local);
+        }
+        cpu_set_t merged;
+        CPU_OR(&merged, &local, &set);
+        if (CPU_EQUAL(&merged, &local)) {
+            if (bound != NO_SHARD) {
+                bound = NO_SHARD;
+                break;
+            }
+            bound = node;
+        }
+    }
+    if (bound != NO_SHARD) {
+        return bound;
+    }
+
+    size_t node = next_node_.fetch_add(1, std::memory_order_relaxed) % shards_.size();
+    CPU_ZERO(&set);
+    for (int cpu : cpus_[node]) {
+        CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return node;
+}
+
+
+/**
+ * 已经有 key 的分片，从本节点分片开始查，都没有时返回 NO_SHARD
+ */
+inline size_t NumaEngine::Owner(const Slice &key, size_t local) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        size_t shard = (local + i) % shards_.size();
+        if (shards_[shard]->Contains(key)) {
+            return shard;
+        }
+    }
+    return NO_SHARD;
+}
+
+
+/**
+ * 先读本节点分片，没有再依次读其他分片。其他分片命中的 key 在本节点分片也记一次 get_misses
+ */
+template<typename T>
+inline Status NumaEngine::Lookup(const Slice &key, T *value) {
+    size_t local = LocalShard();
+    Status s = shards_[local]->Get(key, value);
+    for (size_t i = 1; i < shards_.size() && s == NotFound; ++i) {
+        s = shards_[(local + i) % shards_.size()]->Get(key, value);
+    }
+    return s;
+}
+
+
+/**
+ * 写入一个还不存在的 key。同一段锁内再确认一次其他线程没有先写入，
+ * 本节点分片写满（OutOfMemory）时依次尝试其他分片
+ */
+Status NumaEngine::Insert(const Slice &key, const Slice &value, size_t local) {
+    std::lock_guard<std::mutex> lock(insert_locks_[KeyHash(key.data()) % INSERT_LOCK_NUM]);
+    size_t owner = Owner(key, local);
+    if (owner != NO_SHARD) {
+        return shards_[owner]->Set(key, value);
+    }
+    Status s = OutOfMemory;
+    for (size_t i = 0; i < shards_.size() && s == OutOfMemory; ++i) {
+        s = shards_[(local + i) % shards_.size()]->Set(key, value);
+    }
+    return s;
+}
+
+
+Status NumaEngine::Get(const Slice &key, std::string *value) {
+    return Lookup(key, value);
+}
+
+
+Status NumaEngine::Get(const Slice &key, Slice *value) {
+    return Lookup(key, value);
+}
+
+
+Status NumaEngine::Set(const Slice &key, const Slice &value) {
+    size_t local = LocalShard();
+    size_t owner = Owner(key, local);
+    if (owner != NO_SHARD) {
+        return shards_[owner]->Set(key, value);
+    }
+    if (async_) {
+        return shards_[ShardIndex(key)]->Set(key, value);
+    }
+    return Insert(key, value, local);
+}
+
+
+/**
+ * 整批先在本节点分片上走交错预取的 MultiGet，没找到的 key 再依次到其他分片上查
+ */
+void NumaEngine::MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) {
+    uint32_t index[MULTI_BATCH];
+    Slice sub_keys[MULTI_BATCH];
+    Slice sub_values[MULTI_BATCH];
+    Status sub_statuses[MULTI_BATCH];
+
+    size_t local = LocalShard();
+    shards_[local]->MultiGet(n, keys, values, statuses);
+    for (size_t base = 0; base < n; base += MULTI_BATCH) {
+        size_t batch = n - base < MULTI_BATCH ? n - base : MULTI_BATCH;
+        for (size_t i = 1; i < shards_.size(); ++i) {
+            size_t count = 0;
+            for (size_t j = 0; j < batch; ++j) {
+                if (statuses[base + j] == NotFound) {
+                    index[count] = base + j;
+                    sub_keys[count] = keys[base + j];
+                    sub_values[count] = values[base + j];
+                    ++count;
+                }
+            }
+            if (count == 0) {
+                break;
+            }
+            shards_[(local + i) % shards_.size()]->MultiGet(count, sub_keys, sub_values, sub_statuses);
+            for (size_t j = 0; j < count; ++j) {
+                values[index[j]] = sub_values[j];
+                statuses[index[j]] = sub_statuses[j];
+            }
+        }
+    }
+}
+
+
+/**
+ * 已有的 key 按所属分片拆成子批次，每个分片内仍然走交错预取的 MultiSet；
+ * 新 key 逐个走 Insert，异步写模式下按 hash 归入对应分片的子批次
+ */
+void NumaEngine::MultiSet(size_t n, const Slice *keys, const Slice *values, Status *statuses) {
+    uint32_t index[MAX_SHARD_NUM][MULTI_BATCH];
+    size_t count[MAX_SHARD_NUM];
+    Slice sub_keys[MULTI_BATCH];
+    Slice sub_values[MULTI_BATCH];
+    Status sub_statuses[MULTI_BATCH];
+
+    size_t local = LocalShard();
+    for (size_t base = 0; base < n; base += MULTI_BATCH) {
+        size_t batch = n - base < MULTI_BATCH ? n - base : MULTI_BATCH;
+        std::fill(count, count + shards_.size(), 0);
+        for (size_t i = 0; i < batch; ++i) {
+            size_t shard = Owner(keys[base + i], local);
+            if (shard == NO_SHARD) {
+                if (!async_) {
+                    statuses[base + i] = Insert(keys[base + i], values[base + i], local);
+                    continue;
+                }
+                shard = ShardIndex(keys[base + i]);
+            }
+            index[shard][count[shard]++] = base + i;
+        }
+
+        for (size_t shard = 0; shard < shards_.size(); ++shard) {
+            for (size_t j = 0; j < count[shard]; ++j) {
+                sub_keys[j] = keys[index[shard][j]];
+                sub_values[j] = values[index[shard][j]];
+            }
+            shards_[shard]->MultiSet(count[shard], sub_keys, sub_values, sub_statuses);
+            for (size_t j = 0; j < count[shard]; ++j) {
+                statuses[index[shard][j]] = sub_statuses[j];
+            }
+        }
+    }
+}
+
+
+/**
+ * 汇总各分片：nvm.stats 按分片拼接，nvm.bucket-skew 取最大，其余计数求和
+ */
+bool NumaEngine::GetProperty(const std::string &property, std::string *value) {
+    std::string shard_value;
+    if (property == "nvm.stats") {
+        value->clear();
+        for (auto shard : shards_) {
+            if (!shard->GetProperty(property, &shard_value)) {
+                return false;
+            }
+            *value += shard_value;
+        }
+        return true;
+    }
+
+    bool skew = property == "nvm.bucket-skew";
+    uint64_t sum = 0;
+    double max = 0;
+    for (auto shard : shards_) {
+        if (!shard->GetProperty(property, &shard_value)) {
+            return false;
+        }
+        if (skew) {
+            max = std::max(max, strtod(shard_value.c_str(), nullptr));
+        } else {
+            sum += strtoull(shard_value.c_str(), nullptr, 10);
+        }
+    }
+    if (skew) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.4lf", max);
+        *value = buf;
+    } else {
+        *value = std::to_string(sum);
+    }
+    return true;
+}
+
+
+NumaEngine::~NumaEngine() {
+    for (auto shard : shards_) {
+        delete shard;
+    }
+    if (log_file_) {
+        fclose(log_file_);
+    }
+}
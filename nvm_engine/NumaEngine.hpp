@@ -0,0 +1,83 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/22
+ * @project: tair-contest
+ * @desp: 按 NUMA 节点分片，每个节点一个 PMem 文件和一个 NvmEngine
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_NUMA_ENGINE_H_
+#define TAIR_CONTEST_KV_CONTEST_NUMA_ENGINE_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "NvmEngine.hpp"
+
+
+/**
+ * 每个 key 归属唯一的分片：新 key 写到调用线程所在节点的分片，之后的更新和读取都到这个分片。
+ * 没有绑定在某一个节点上的客户线程第一次访问时按到达顺序轮流绑定到各节点，
+ * 线程主要访问自己写入的 key 时读写都在本节点内。
+ * 读先查本节点分片再查其他分片；新 key 插入前按 hash 分段加锁并确认其他分片没有这个 key。
+ * 异步写模式下排队中的 key 对其他线程不可见，新 key 改为按 hash 选分片，保证同一个 key 不会落到两个分片。
+ * 每个分片在绑定到本节点 CPU 的线程上创建，索引内存优先从本节点分配，
+ * 恢复线程和压缩线程继承这个绑定，所以分片的后台访问都在本节点内
+ */
+class NumaEngine : DB {
+public:
+    /**
+     * @param
+     * paths: 每个 NUMA 节点一个 PMem 文件，分片 i 对应节点 i
+     */
+    NumaEngine(const std::vector<std::string> &paths, FILE *log_file, const Options &options);
+
+    static Status CreateOrOpen(const std::vector<std::string> &paths, DB **dbptr, FILE *log_file,
+                               const Options &options);
+
+    Status Get(const Slice &key, std::string *value) override;
+
+    Status Get(const Slice &key, Slice *value) override;
+
+    Status Set(const Slice &key, const Slice &value) override;
+
+    void MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) override;
+
+    void MultiSet(size_t n, const Slice *keys, const Slice *values, Status *statuses) override;
+
+    bool GetProperty(const std::string &property, std::string *value) override;
+
+    ~NumaEngine() override;
+
+private:
+    static std::vector<std::vector<int>> NodeCpus(size_t node_num, bool *emulated);
+
+    static std::vector<int> ParseCpuList(const std::string &list);
+
+    inline size_t ShardIndex(const Slice &key) const;
+
+    inline size_t LocalShard();
+
+    size_t BindThread();
+
+    inline size_t Owner(const Slice &key, size_t local);
+
+    template<typename T>
+    inline Status Lookup(const Slice &key, T *value);
+
+    Status Insert(const Slice &key, const Slice &value, size_t local);
+
+private:
+    const static size_t MAX_SHARD_NUM = 8;
+    const static size_t MULTI_BATCH = 64;   //  MultiGet / MultiSet 每批按分片拆开的 key 数
+    const static size_t NO_SHARD = MAX_SHARD_NUM;
+    const static size_t INSERT_LOCK_NUM = 256;
+
+    std::vector<NvmEngine *> shards_;
+    std::vector<std::vector<int>> cpus_;    //  各节点的 CPU
+    std::atomic<size_t> next_node_;         //  下一个未绑定线程绑定到的节点
+    bool async_;
+    std::mutex insert_locks_[INSERT_LOCK_NUM];
+    FILE *log_file_;
+};
+
+#endif
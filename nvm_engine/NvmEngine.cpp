@@ -11,13 +11,34 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <mutex>
-#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstddef>
 #include "NvmEngine.hpp"
+#include "NumaEngine.hpp"
+#include "ThreadLogEngine.hpp"
+#include "TraceRecorder.hpp"
+
+#ifndef CLION
+#include "include/crc32c.hpp"
+#else
+#include "crc32c.hpp"
+#endif
 
 #define LIKELY(x) (__builtin_expect((x), 1))
 #define UNLIKELY(x) (__builtin_expect((x), 0))
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 
 //  <-------- DB -------->
 
@@ -26,123 +47,1873 @@ Status DB::CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file) {
 }
 
 
+Status DB::CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file, const Options &options) {
+    Status status;
+    if (!options.numa_paths.empty()) {
+        status = NumaEngine::CreateOrOpen(options.numa_paths, dbptr, log_file, options);
+    } else if (options.layout == LayoutThread) {
+        status = ThreadLogEngine::CreateOrOpen(name, dbptr, log_file, options);
+    } else {
+        status = NvmEngine::CreateOrOpen(name, dbptr, log_file, options);
+    }
+    if (status == Ok && !options.trace_path.empty()) {
+        *dbptr = new TraceRecorder(*dbptr, options.trace_path, log_file);
+    }
+    return status;
+}
+
+
 DB::~DB() {}
 
 //  <-------- NvmEngine -------->
 
-NvmEngine::NvmEngine(const std::string &name, FILE *log_file) : get_count_(0), set_count_(0), log_file_(log_file) {
-    BuildMapping(name, MAP_SIZE);
+NvmEngine::NvmEngine(const std::string &name, FILE *log_file, const Options &options, int node)
+        : PmemEngine(log_file, options), node_(node), huge_pages_(options.huge_pages), cache_(nullptr), slab_(nullptr), compaction_rate_(options.compaction_rate),
+          checkpoint_period_sec_(options.checkpoint_period_sec), flusher_num_(options.async_flushers),
+          in_place_(options.in_place_updates), versions_(nullptr), stop_(false),
+          compacted_segments_(0), compacted_bytes_(0), checkpoints_(0), checkpoint_bytes_(0), flush_stop_(false),
+          async_flushed_(0), async_waits_(0) {
+    for (auto &queue : get_queues_) {
+        queue.lock.store(false, std::memory_order_relaxed);
+#ifndef USE_COROUTINE
+        queue.count = 0;
+#endif
+    }
+    if (durability_ != DurabilityStrict) {
+        PrintLog("[NvmEngine::NvmEngine] durability: %s\n", durability_ == DurabilityGroup ? "group" : "relaxed");
+    }
+    if (in_place_) {
+        versions_ = new std::atomic<uint32_t>[VERSION_NUM]();
+        PrintLog("[NvmEngine::NvmEngine] in-place updates enabled\n");
+    }
+    if (options.cache_size > 0) {
+        cache_ = new ReadCache(options.cache_size);
+        PrintLog("[NvmEngine::NvmEngine] read cache enabled, capacity: %lu\n", cache_->Capacity());
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool exist = access(name.c_str(), F_OK) == 0;
+    BuildMapping(name, FILE_SIZE + options.slab_size, exist);
+    if (!exist) {
+        //  新文件先写文件头，CheckLayout 据此确认之后打开的是同一种布局
+        bucket_superblock *super = (bucket_superblock *) (pmem_base_ + SUPER_OFFSET);
+        super->magic = MAGIC;
+        super->bucket_num = BUCKET_NUM;
+        super->pair_size = PAIR_SIZE;
+        super->record_num = RECORD_NUM;
+        Persist(super, sizeof(bucket_superblock));
+    }
     InitBucket();
+    auto mapped = std::chrono::steady_clock::now();
+
+    //  恢复和写入都会访问整个映射，预先并行触发缺页，避免之后在 mm 锁上逐页串行。
+    //  只对 DAX 映射预取：页缓存上的文件按大 folio 预读后，每次写入都会把整个 folio 标脏并写回
+    if (options.prefault_threads > 0) {
+#ifdef USE_LIBPMEM
+        if (is_pmem_) {
+            Prefault(pmem_base_, mapped_size_, options.prefault_threads);
+        } else {
+            PrintLog("[NvmEngine::NvmEngine] %s is not on DAX, prefault the index only\n", name.c_str());
+        }
+#endif
+        Prefault((char *) index_, INDEX_SIZE, options.prefault_threads);
+    }
+    auto prefaulted = std::chrono::steady_clock::now();
+
+    //  文件中超出 FILE_SIZE 的部分是 slab 区域，重新打开时以文件实际大小为准
+    if (mapped_size_ > FILE_SIZE) {
+#ifdef USE_LIBPMEM
+        bool is_pmem = is_pmem_;
+#else
+        bool is_pmem = false;
+#endif
+        slab_ = new SlabAllocator(pmem_base_ + FILE_SIZE, mapped_size_ - FILE_SIZE, is_pmem, exist);
+        PrintLog("[NvmEngine::NvmEngine] variable-length values enabled, slab size: %lu\n", mapped_size_ - FILE_SIZE);
+    }
+
+    if (exist) {
+        Recover();
+    }
+
+    if (compaction_rate_ > 0) {
+        compactor_ = std::thread(&NvmEngine::CompactLoop, this);
+    }
+    if (options.stats_dump_period_sec > 0) {
+        dumper_ = std::thread(&NvmEngine::DumpLoop, this, options.stats_dump_period_sec);
+    }
+    if (checkpoint_period_sec_ > 0) {
+        checkpointer_ = std::thread(&NvmEngine::CheckpointLoop, this, checkpoint_period_sec_);
+    }
+    if (flusher_num_ > 0) {
+        for (uint32_t i = 0; i < flusher_num_; ++i) {
+            rings_.push_back(new WriteRing(std::max(options.async_ring_records, 1u)));
+        }
+        for (uint32_t i = 0; i < flusher_num_; ++i) {
+            flushers_.emplace_back(&NvmEngine::FlushLoop, this, i);
+        }
+        PrintLog("[NvmEngine::NvmEngine] async writes with %u flushers, %u records per flusher ring\n",
+                 flusher_num_, options.async_ring_records);
+    }
+
+    auto opened = std::chrono::steady_clock::now();
+    PrintLog("[NvmEngine::NvmEngine] open in %.2lf ms (map %.2lf ms, prefault %.2lf ms, recover %.2lf ms)\n",
+             std::chrono::duration<double, std::milli>(opened - start).count(),
+             std::chrono::duration<double, std::milli>(mapped - start).count(),
+             std::chrono::duration<double, std::milli>(prefaulted - mapped).count(),
+             std::chrono::duration<double, std::milli>(opened - prefaulted).count());
 }
 
 
 Status NvmEngine::CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file) {
-    NvmEngine *db = new NvmEngine(name, log_file);
+    return CreateOrOpen(name, dbptr, log_file, Options());
+}
+
+
+Status NvmEngine::CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file, const Options &options) {
+    Status status = CheckLayout(name, log_file);
+    if (status != Ok) {
+        return status;
+    }
+    NvmEngine *db = new NvmEngine(name, log_file, options);
     *dbptr = db;
     return Ok;
 }
 
 
-void NvmEngine::BuildMapping(const std::string &name, size_t size) {
-#ifdef USE_LIBPMEM
-    if ((pmem_base_ = (char *) pmem_map_file(name.c_str(), size, PMEM_FILE_CREATE, 0666, &mapped_size_, &is_pmem_)) ==
-        NULL) {
-        perror("[NvmEngine::BuildMapping] pmem map file failed");
-        exit(1);
-    } else {
-        PrintLog("[NvmEngine::BuildMapping] pmem map file successed\n");
+Status NvmEngine::CheckLayout(const std::string &name, FILE *log_file) {
+    static_assert(sizeof(bucket_superblock) <= SUPER_SIZE, "superblock overflows its page");
+    bucket_superblock super;
+    if (!ReadSuperblock(name, SUPER_OFFSET, &super, sizeof(super))) {
+        return Ok;
+    }
+    if (super.magic != MAGIC || super.bucket_num != BUCKET_NUM || super.pair_size != PAIR_SIZE ||
+        super.record_num != RECORD_NUM) {
+        if (log_file) {
+            fprintf(log_file, "[NvmEngine::CheckLayout] %s was not created with the bucket layout of this build\n",
+                    name.c_str());
+            fflush(log_file);
+        }
+        return IOError;
+    }
+    return Ok;
+}
+
+
+void NvmEngine::InitBucket() {
+    static_assert(RECORD_NUM < (1ull << NO_BITS), "record number overflows index entry");
+    static_assert(RECORD_NUM <= INDEX_GROUP_NUM * GROUP_SLOT_NUM / 4 * 3, "index load factor exceeds 0.75");
+    static_assert(sizeof(index_group) == 64, "index_group should be one cache line");
+    static_assert(INDEX_SIZE <= INDEX_BUDGET, "index exceeds the DRAM budget");
+    static_assert(sizeof(checkpoint_header) == 64, "checkpoint_header should be one cache line");
+    static_assert(INDEX_GROUP_NUM * GROUP_SLOT_NUM < (1ull << 24), "slot number overflows checkpoint entry");
+#ifndef LOCAL
+    static_assert(BUCKET_NUM * (RECORD_NUM - SEGMENT_RECORD_NUM) >= CONTEST_KEY_NUM,
+                  "usable records are fewer than the keys written by the contest");
+#endif
+
+    //  每个槽只有 1 字节 tag 和 4 字节索引项，key 留在 PMem 中，tag 命中后再去比较
+    MapIndex(INDEX_SIZE, huge_pages_);
+    if (node_ >= 0) {
+        BindIndex(INDEX_SIZE);
+    }
+    PrintLog("[NvmEngine::InitBucket] index %.2lf MB for %lu records, %.2lf bytes per record\n",
+             INDEX_SIZE / 1048576.0, BUCKET_NUM * RECORD_NUM, (double) INDEX_SIZE / (BUCKET_NUM * RECORD_NUM));
+
+    for (uint16_t i = 0; i < BUCKET_NUM; ++i) {
+        bucket &b = buckets_[i];
+        char *meta = pmem_base_ + MAP_SIZE + i * META_BUCKET_SIZE;
+        b.ptr = pmem_base_ + i * BUCKET_SIZE;
+        b.headers = (record_header *) meta;
+        b.checkpoint = (checkpoint_header *) (meta + CHECKPOINT_OFFSET);
+        b.checkpoint_entries = (checkpoint_entry *) (b.checkpoint + 1);
+        b.index = index_ + i * INDEX_GROUP_NUM;
+        b.head_ptr = (uint64_t *) (meta + META_BUCKET_SIZE - sizeof(uint64_t));
+        b.tail.store(0, std::memory_order_relaxed);
+        b.head.store(0, std::memory_order_relaxed);
+        b.reserved.store(0, std::memory_order_relaxed);
+        b.live.store(0, std::memory_order_relaxed);
+        b.writers.store(0, std::memory_order_relaxed);
+        b.waiters.store(0, std::memory_order_relaxed);
+        b.epoch.store(0, std::memory_order_relaxed);
+        b.exclusive.store(false, std::memory_order_relaxed);
+        b.checkpoint_head = 0;
+        b.checkpoint_tail = 0;
+        b.checkpoint_valid = false;
+    }
+}
+
+
+/**
+ * 索引页优先分配在 node_ 上（MPOL_PREFERRED，不依赖 libnuma）；
+ * 模拟的 NUMA 拓扑中节点不存在，mbind 失败时保持默认策略
+ */
+void NvmEngine::BindIndex(size_t size) {
+    const int MPOL_PREFERRED = 1;
+    unsigned long mask = 1ul << node_;
+    if (syscall(SYS_mbind, index_, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+        PrintLog("[NvmEngine::BindIndex] bind index to node %d failed, keep default policy\n", node_);
+    }
+}
+
+
+/**
+ * 多线程触发 [addr, addr + size) 的缺页，每个线程负责连续的一段（按 2M 切分）。
+ * 优先用 MADV_POPULATE_WRITE（Linux 5.14+）直接建立可写映射，不读写数据；
+ * 内核不支持时每页读一个字节再原样写回，打开期间没有其他线程访问映射，写回不会改变内容。
+ * 线程继承调用者的 CPU 绑定，索引页按 BindIndex 设置的策略分配
+ */
+void NvmEngine::Prefault(char *addr, size_t size, uint32_t thread_num) {
+    size_t chunk = (size / thread_num + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (chunk == 0) {
+        chunk = HUGE_PAGE_SIZE;
+    }
+    std::vector<std::thread> workers;
+    for (size_t off = 0; off < size; off += chunk) {
+        workers.emplace_back([addr, off, chunk, size]() {
+            char *begin = addr + off;
+            size_t len = std::min(chunk, size - off);
+            if (madvise(begin, len, MADV_POPULATE_WRITE) == 0) {
+                return;
+            }
+            const size_t page_size = 4096;
+            for (size_t i = 0; i < len; i += page_size) {
+                volatile char *p = begin + i;
+                *p = *p;
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+
+/**
+ * 每个核一个线程，按桶领取任务并行执行 func
+ */
+unsigned int NvmEngine::ForEachBucket(const std::function<void(bucket &)> &func) {
+    unsigned int thread_num = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<uint32_t> next_bucket(0);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < thread_num; ++i) {
+        workers.emplace_back([this, &next_bucket, &func]() {
+            uint32_t index;
+            while ((index = next_bucket.fetch_add(1, std::memory_order_relaxed)) < BUCKET_NUM) {
+                func(buckets_[index]);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return thread_num;
+}
+
+
+/**
+ * 重启恢复：并行地为每个桶加载索引检查点并重放其后的记录，没有可用检查点的桶扫描整个日志；
+ * 启用 slab 时再并行扫描一遍索引，标记仍被引用的 chunk，其余 chunk 回收到空闲链表
+ */
+void NvmEngine::Recover() {
+    auto start = std::chrono::steady_clock::now();
+
+    std::atomic<uint64_t> record_num(0);
+    std::atomic<uint64_t> torn_num(0);
+    std::atomic<uint64_t> restored_num(0);
+    std::atomic<uint64_t> replayed_num(0);
+    unsigned int thread_num = ForEachBucket([&](bucket &b) {
+        bool restored;
+        uint64_t replayed;
+        torn_num.fetch_add(RecoverBucket(b, &restored, &replayed), std::memory_order_relaxed);
+        restored_num.fetch_add(restored, std::memory_order_relaxed);
+        replayed_num.fetch_add(replayed, std::memory_order_relaxed);
+        record_num.fetch_add(b.tail.load(std::memory_order_relaxed) - b.head.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+    });
+
+    if (slab_) {
+        ForEachBucket([this](bucket &b) {
+            for (uint64_t group = 0; group < INDEX_GROUP_NUM; ++group) {
+                for (uint32_t entry : b.index[group].entries) {
+                    if (entry != 0 && EntryIndirect(entry)) {
+                        slab_->MarkLive(Descriptor(b, entry)->off);
+                    }
+                }
+            }
+        });
+        slab_->Rebuild();
+    }
+
+    double cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    PrintLog("[NvmEngine::Recover] recover %lu records with %u threads in %.2lf ms, skip %lu torn records\n",
+             record_num.load(), thread_num, cost, torn_num.load());
+    PrintLog("[NvmEngine::Recover] %lu buckets from checkpoints, %lu by full scan, replay %lu records\n",
+             restored_num.load(), BUCKET_NUM - restored_num.load(), replayed_num.load());
+}
+
+
+/**
+ * 先尝试从检查点恢复，只重放检查点之后的记录；检查点无效、过期或者它引用的 chunk 已不完整时，
+ * 清空这个桶的索引，退回到重放整个日志。返回跳过的写了一半的记录数，replayed 返回重放的记录数
+ */
+uint64_t NvmEngine::RecoverBucket(bucket &b, bool *restored, uint64_t *replayed) {
+    uint64_t head = *b.head_ptr;
+    b.head.store(head, std::memory_order_relaxed);
+    *restored = false;
+    *replayed = 0;
+    uint64_t torn = 0;
+    if (LoadCheckpoint(b)) {
+        uint64_t checkpoint_tail = b.checkpoint->tail;
+        torn = ReplayLog(b, checkpoint_tail, replayed);
+        *restored = slab_ == nullptr || CheckChunks(b);
+        if (*restored) {
+            b.checkpoint_valid = b.checkpoint->head == head && b.tail.load(std::memory_order_relaxed) == checkpoint_tail;
+        } else {
+            memset(b.index, 0, INDEX_GROUP_NUM * sizeof(index_group));
+        }
+    }
+    if (!*restored) {
+        *replayed = 0;
+        b.tail.store(head, std::memory_order_relaxed);
+        b.live.store(0, std::memory_order_relaxed);
+        torn += ReplayLog(b, head, replayed);
+    }
+    b.checkpoint_head = head;
+    b.checkpoint_tail = b.tail.load(std::memory_order_relaxed);
+    b.reserved.store(b.checkpoint_tail, std::memory_order_relaxed);
+    return torn;
+}
+
+
+/**
+ * 校验检查点并把检查点项放回原来的槽位，设置 tail 和 live；检查点无效时不修改索引，返回 false。
+ * 检查点之后压缩器可能回收了 [检查点的 head, head)，指向这一段的项已经过期，直接丢弃；
+ * 丢弃的槽位会截断经过它的探测序列，所以不在起始组的项（溢出位为 1）这时要按 key 的 hash 重新发布。
+ * 回收超过检查点的 tail 时，之后的记录可能也被回收了，检查点不能用
+ */
+bool NvmEngine::LoadCheckpoint(bucket &b) {
+    const checkpoint_header &header = *b.checkpoint;
+    uint64_t head = b.head.load(std::memory_order_relaxed);
+    if (header.head > head || header.tail < head || header.tail - header.head > RECORD_NUM ||
+        header.count > RECORD_NUM || CheckpointCrc(header, b.checkpoint_entries) != header.crc) {
+        return false;
+    }
+    bool reclaimed = header.head != head;
+    uint64_t live = 0;
+    for (uint32_t i = 0; i < header.count; ++i) {
+        checkpoint_entry ce = b.checkpoint_entries[i];
+        uint32_t slot = ce.slot >> 8;
+        if (UNLIKELY(slot >= INDEX_GROUP_NUM * GROUP_SLOT_NUM)) {
+            memset(b.index, 0, INDEX_GROUP_NUM * sizeof(index_group));
+            return false;
+        }
+        bool overflow = (ce.slot & 0x80) != 0;
+        if (reclaimed && (CheckpointSequence(header, EntryNo(ce.entry)) < head || overflow)) {
+            continue;
+        }
+        index_group &g = b.index[slot / GROUP_SLOT_NUM];
+        g.entries[slot % GROUP_SLOT_NUM] = ce.entry;
+        g.tags[slot % GROUP_SLOT_NUM] = (uint8_t) (ce.slot | 0x80);
+        g.overflow |= (uint32_t) overflow << (slot % GROUP_SLOT_NUM);
+        ++live;
+    }
+    if (reclaimed) {
+        for (uint32_t i = 0; i < header.count; ++i) {
+            checkpoint_entry ce = b.checkpoint_entries[i];
+            uint64_t seq = CheckpointSequence(header, EntryNo(ce.entry));
+            if ((ce.slot & 0x80) != 0 && seq >= head) {
+                const char *key = b.ptr + EntryNo(ce.entry) * PAIR_SIZE;
+                Publish(b, Hash(key), key, seq, EntryIndirect(ce.entry));
+                ++live;
+            }
+        }
+    }
+    b.tail.store(header.tail, std::memory_order_relaxed);
+    b.live.store(live, std::memory_order_relaxed);
+    return true;
+}
+
+
+/**
+ * 重放序列号在 [from, head + RECORD_NUM) 内的记录，返回跳过的记录数，replayed 累加重放的记录数。
+ * 只重放记录头和校验和都完整的记录；崩溃时写了一半的记录清除记录头后跳过。
+ * 日志是环形的，有效记录都在 [head, head + RECORD_NUM) 内，按序列号决定同一个 key 的新旧。
+ * 按序列号从新到旧扫描，每个 key 最先发布的就是最新版本，更旧的版本在 Publish 中直接淘汰，
+ * 所以只需要检查最新版本的 chunk 校验和；不符时撤销这次发布，让次新的版本（或检查点中的版本）顶上
+ */
+uint64_t NvmEngine::ReplayLog(bucket &b, uint64_t from, uint64_t *replayed) {
+    uint64_t head = b.head.load(std::memory_order_relaxed);
+    uint64_t tail = b.tail.load(std::memory_order_relaxed);
+    uint64_t torn = 0;
+    for (uint64_t seq = head + RECORD_NUM; seq-- > from;) {
+        uint64_t no = seq % RECORD_NUM;
+        if (b.headers[no].meta == 0) {
+            continue;
+        }
+        if (!CheckRecord(b, no, seq)) {
+            memset(b.headers + no, 0, sizeof(record_header));
+            Flush(b.headers + no, sizeof(record_header));
+            ++torn;
+            continue;
+        }
+        tail = std::max(tail, seq + 1);
+        ++*replayed;
+
+        const char *pair = b.ptr + no * PAIR_SIZE;
+        uint64_t hash = Hash(pair);
+        bool indirect = (b.headers[no].meta & 3) == VALID_INDIRECT;
+        uint32_t entry = MakeEntry(Tag(hash), indirect, no);
+        uint32_t stale = Publish(b, hash, pair, seq, indirect);
+        if (stale == entry) {
+            continue;
+        }
+        if (indirect && !CheckChunk(pair)) {
+            //  恢复中每个桶只有一个线程，撤销后索引与发布前完全相同
+            uint32_t *slot = Find(b, hash, pair, &entry);
+            __atomic_store_n(slot, stale, __ATOMIC_RELAXED);
+            if (stale == 0) {
+                index_group *g = (index_group *) ((uintptr_t) slot & ~(uintptr_t) (sizeof(index_group) - 1));
+                g->tags[slot - g->entries] = 0;
+                g->overflow &= ~(1u << (slot - g->entries));
+            }
+            continue;
+        }
+        if (stale == 0) {
+            b.live.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (torn > 0) {
+        Drain();
+    }
+    b.tail.store(tail, std::memory_order_relaxed);
+    return torn;
+}
+
+
+/**
+ * 检查点中的变长 value 记录没有经过重放，它们的 chunk 要单独校验：
+ * 写路径不等待落盘时，chunk 可能在检查点之后被释放复用而新版本没有落盘。
+ * 只检查重放之后仍留在索引中的检查点项，按检查点数组遍历，不扫描整个索引；
+ * 重新发布过的溢出项不一定还在原来的槽位，按 key 查找
+ */
+bool NvmEngine::CheckChunks(bucket &b) {
+    const checkpoint_header &header = *b.checkpoint;
+    uint64_t head = b.head.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < header.count; ++i) {
+        checkpoint_entry ce = b.checkpoint_entries[i];
+        if (!EntryIndirect(ce.entry) || CheckpointSequence(header, EntryNo(ce.entry)) < head) {
+            continue;
+        }
+        const char *pair = b.ptr + EntryNo(ce.entry) * PAIR_SIZE;
+        uint32_t slot = ce.slot >> 8;
+        uint32_t entry = b.index[slot / GROUP_SLOT_NUM].entries[slot % GROUP_SLOT_NUM];
+        if ((ce.slot & 0x80) != 0 && Find(b, Hash(pair), pair, &entry) == nullptr) {
+            continue;
+        }
+        if (entry == ce.entry && !CheckChunk(pair)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * 把序列号为 seq 的记录发布到索引。同一个 key 只保留序列号最大的版本，
+ * 这样并发覆盖写以及恢复后的结果都与日志顺序一致。
+ * 调用者处于桶的写者区间内（或在恢复中），head 不会变化。
+ * 返回被淘汰的索引项（被覆盖的旧版本，或者比已有版本旧的自己），没有则返回 0。
+ * 写者按索引项逐个检查而不依赖 tag 字节，因为别的写者可能已占住槽位但还没写 tag
+ */
+inline uint32_t NvmEngine::Publish(bucket &b, uint64_t hash, const char *key, uint64_t seq, bool indirect) {
+    uint32_t tag = Tag(hash);
+    uint32_t entry = MakeEntry(tag, indirect, seq % RECORD_NUM);
+    uint64_t home = GroupIndex(hash);
+    uint64_t group = home;
+
+    while (true) {
+        index_group &g = b.index[group];
+        for (uint32_t i = 0; i < GROUP_SLOT_NUM; ++i) {
+            uint32_t *slot = g.entries + i;
+            uint32_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            if (cur == 0) {
+                if (__atomic_compare_exchange_n(slot, &cur, entry, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                    __atomic_store_n(g.tags + i, TagByte(hash), __ATOMIC_RELEASE);
+                    if (UNLIKELY(group != home)) {
+                        __atomic_fetch_or(&g.overflow, 1u << i, __ATOMIC_RELAXED);
+                    }
+                    return 0;
+                }
+                //  被其他写者抢先，cur 已更新为抢先写入的索引项，接着检查这个槽
+            }
+            if (EntryTag(cur) == tag && memcmp(b.ptr + EntryNo(cur) * PAIR_SIZE, key, KEY_SIZE) == 0) {
+                //  CAS 失败时 cur 会更新为同一个 key 的另一个版本
+                while (Sequence(b, EntryNo(cur)) < seq) {
+                    if (__atomic_compare_exchange_n(slot, &cur, entry, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                        return cur;
+                    }
+                }
+                return entry;
+            }
+        }
+        group = group + 1 == INDEX_GROUP_NUM ? 0 : group + 1;
     }
+}
+
+
+inline uint32_t NvmEngine::MakeEntry(uint32_t tag, bool indirect, uint64_t no) {
+    return (tag << (NO_BITS + 1)) | ((uint32_t) indirect << NO_BITS) | (uint32_t) (no + 1);
+}
+
+
+inline uint32_t NvmEngine::EntryTag(uint32_t entry) {
+    return entry >> (NO_BITS + 1);
+}
+
+
+inline bool NvmEngine::EntryIndirect(uint32_t entry) {
+    return (entry >> NO_BITS) & 1;
+}
+
+
+inline uint64_t NvmEngine::EntryNo(uint32_t entry) {
+    return (entry & NO_MASK) - 1;
+}
+
+
+/**
+ * 环形日志中记录号 no 对应的序列号
+ */
+inline uint64_t NvmEngine::Sequence(bucket &b, uint64_t no) {
+    uint64_t head = b.head.load(std::memory_order_acquire);
+    return head + (no + RECORD_NUM - head % RECORD_NUM) % RECORD_NUM;
+}
+
+
+inline const value_desc *NvmEngine::Descriptor(bucket &b, uint32_t entry) {
+    return (const value_desc *) (b.ptr + EntryNo(entry) * PAIR_SIZE + KEY_SIZE);
+}
+
+
+/**
+ * 低 10 位选桶，其上 32 位选起始索引组，再往上 7 位作为组内 tag 字节，最高 11 位作为索引项 tag
+ */
+inline uint64_t NvmEngine::Hash(const char *key) {
+#ifndef STRING_HASH
+    return KeyHash(key);
 #else
-    int fd = open(name.c_str(), O_RDWR | O_CREAT, 00777);
-    lseek(fd, size - 1, SEEK_END);
-    write(fd, " ", 1);
-    pmem_base_ = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (pmem_base_ == MAP_FAILED) {
-        PrintLog("[NvmEngine::BuildMapping] mmap failed\n");
-        perror("mmap failed");
-        exit(1);
-    } else {
-        mapped_size_ = size;
-        PrintLog("[NvmEngine::BuildMapping] mmap successed\n");
+    return std::hash<std::string>()(std::string(key, KEY_SIZE));
+#endif
+}
+
+
+inline uint16_t NvmEngine::BucketIndex(uint64_t hash) {
+    return hash & (BUCKET_NUM - 1);
+}
+
+
+/**
+ * 组数不是 2 的幂，用乘法代替取模把 32 位 hash 映射到 [0, INDEX_GROUP_NUM)
+ */
+inline uint64_t NvmEngine::GroupIndex(uint64_t hash) {
+    return (((hash >> 10) & 0xffffffffull) * INDEX_GROUP_NUM) >> 32;
+}
+
+
+/**
+ * 组内 tag 字节：最高位置 1 表示占用，低 7 位取自与组号、索引项 tag 都不重叠的位
+ */
+inline uint8_t NvmEngine::TagByte(uint64_t hash) {
+    return (uint8_t) (((hash >> 42) & 0x7f) | 0x80);
+}
+
+
+inline uint32_t NvmEngine::Tag(uint64_t hash) {
+    return hash >> (64 - TAG_BITS);
+}
+
+
+/**
+ * 非临时写拷贝，不等待完成；一批拷贝之后只需要一次 Drain
+ */
+inline void NvmEngine::CopyNoDrain(char *dst, const char *src, size_t len, bool flush) {
+#ifdef USE_LIBPMEM
+    if (is_pmem_) {
+        NtCopy(dst, src, len);
+        return;
     }
 #endif
+    memcpy(dst, src, len);
+    if (flush) {
+        Flush(dst, len);
+    }
 }
 
 
-void NvmEngine::InitBucket() {
-    uint64_t delta = 0;
-    for (auto &bucket : buckets_) {
-        bucket.ptr = pmem_base_ + delta;
-        delta += BUCKET_NUM;
+/**
+ * 写路径上的刷出，DurabilityRelaxed 下跳过，关闭时由 PersistAll 统一持久化
+ */
+inline void NvmEngine::FlushWrite(const void *addr, size_t len) {
+    if (durability_ != DurabilityRelaxed) {
+        Flush(addr, len);
+    }
+}
+
+
+/**
+ * 关闭时持久化写路径上没有刷出的数据。DAX 上记录是非临时写，只需要刷出记录头和 slab；
+ * 其他文件整体 msync，内核只写回脏页
+ */
+void NvmEngine::PersistAll() {
+#ifdef USE_LIBPMEM
+    if (is_pmem_) {
+        for (auto &b : buckets_) {
+            Flush(b.headers, RECORD_NUM * sizeof(record_header));
+        }
+        if (slab_) {
+            slab_->Persist();
+        }
+        Drain();
+        return;
     }
+#endif
+    Flush(pmem_base_, mapped_size_);
 }
 
 
-inline uint16_t NvmEngine::Hash(const std::string &key) {
-    return str_hash_(key) & (BUCKET_NUM - 1);
+/**
+ * 在桶 b 中查找 key，返回索引项所在的槽，entry 为读到的索引项；不存在返回 nullptr。
+ * 每组一次 SIMD 比较出 tag 命中的槽，只对命中的槽读 PMem 比较完整的 key；
+ * 组内还有空的索引项说明 key 不在后面的组中
+ */
+inline uint32_t *NvmEngine::Find(bucket &b, uint64_t hash, const char *key, uint32_t *entry) {
+    uint64_t group = GroupIndex(hash);
+    uint8_t tag_byte = TagByte(hash);
+    uint32_t tag = Tag(hash);
+
+    while (true) {
+        index_group &g = b.index[group];
+        uint32_t mask = MatchTag(g, tag_byte);
+        while (mask != 0) {
+            uint32_t *slot = g.entries + __builtin_ctz(mask);
+            uint32_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            if (EntryTag(cur) == tag && memcmp(b.ptr + EntryNo(cur) * PAIR_SIZE, key, KEY_SIZE) == 0) {
+                *entry = cur;
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+        if (HasEmpty(g)) {
+            return nullptr;
+        }
+        group = group + 1 == INDEX_GROUP_NUM ? 0 : group + 1;
+    }
 }
 
 
-Status NvmEngine::Get(const Slice &key, std::string *value) {
-    if (++get_count_ % DISPLAY_NUM == 0) {
-        std::lock_guard<std::mutex> lock(log_mut_);
-        PrintLog("[NvmEngine::Get] get count: %u\n", get_count_);
+/**
+ * 查找 key 并把 value 拷贝到 value->data()，缓冲区约定同 DB::Get(const Slice &, Slice *)。
+ * 压缩回收一段日志之前会增加桶的 epoch，回收的位置之后会被新记录复用，
+ * 所以读完之后 epoch 变了就重读（seqlock）。
+ * 变长 value 的 chunk 在新版本发布后会被释放复用，拷贝后还要确认索引项没有变化
+ */
+inline Status NvmEngine::Read(const Slice &key, uint64_t hash, Slice *value) {
+    engine_stat &stat = Stat();
+    Add(stat.gets);
+
+    //  异步写模式下还没写到 PMem 的值比索引中的新
+    if (flusher_num_ > 0) {
+        WriteRing &ring = Ring(hash);
+        if (!ring.Empty()) {
+            char buf[VALUE_SIZE];
+            ring.Lock();
+            bool queued = ring.Find(hash, key.data(), buf);
+            ring.Unlock();
+            if (queued) {
+                if (UNLIKELY(value->size() < VALUE_SIZE)) {
+                    value->size() = VALUE_SIZE;
+                    return OutOfMemory;
+                }
+                memcpy(value->data(), buf, VALUE_SIZE);
+                value->size() = VALUE_SIZE;
+                return Ok;
+            }
+        }
+    }
+
+    uint32_t generation = 0;
+    if (cache_ && value->size() >= VALUE_SIZE) {
+        if (cache_->Get(hash, key.data(), value->data())) {
+            value->size() = VALUE_SIZE;
+            return Ok;
+        }
+        generation = cache_->Generation(hash);
     }
 
-    uint16_t index = Hash(key.to_string());
+    bucket &b = buckets_[BucketIndex(hash)];
+    while (true) {
+        uint32_t epoch = b.epoch.load(std::memory_order_acquire);
+        uint32_t entry;
+        uint32_t *slot = Find(b, hash, key.data(), &entry);
+        if (slot == nullptr) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (UNLIKELY(b.epoch.load(std::memory_order_relaxed) != epoch)) {
+                continue;
+            }
+            Add(stat.get_misses);
+            return NotFound;
+        }
+
+        if (LIKELY(!EntryIndirect(entry))) {
+            if (UNLIKELY(value->size() < VALUE_SIZE)) {
+                value->size() = VALUE_SIZE;
+                return OutOfMemory;
+            }
+            //  原地更新模式下还要确认拷贝期间记录没有被覆盖
+            uint32_t version = 0;
+            if (in_place_) {
+                version = Version(b, EntryNo(entry)).load(std::memory_order_acquire);
+                if (UNLIKELY(version & 1)) {
+                    _mm_pause();
+                    continue;
+                }
+            }
+            memcpy(value->data(), b.ptr + EntryNo(entry) * PAIR_SIZE + KEY_SIZE, VALUE_SIZE);
+            uint64_t seq = Sequence(b, EntryNo(entry));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (UNLIKELY(b.epoch.load(std::memory_order_relaxed) != epoch)) {
+                continue;
+            }
+            if (in_place_ && UNLIKELY(Version(b, EntryNo(entry)).load(std::memory_order_relaxed) != version)) {
+                continue;
+            }
+            value->size() = VALUE_SIZE;
+            if (cache_) {
+                cache_->Insert(hash, key.data(), value->data(), seq, generation);
+            }
+            return Ok;
+        }
 
-    if (!fast_map_[index].empty()) {
-        auto kv = fast_map_[index].find(key.to_string());
-        if (kv != fast_map_[index].end()) {
-            *value = kv->second;
+        //  先确认读到的 value_desc 完整，再按它访问 slab
+        const value_desc *desc = Descriptor(b, entry);
+        uint64_t off = desc->off;
+        uint64_t size = desc->size;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (UNLIKELY(b.epoch.load(std::memory_order_relaxed) != epoch)) {
+            continue;
+        }
+        if (value->size() < size) {
+            value->size() = size;
+            return OutOfMemory;
+        }
+        memcpy(value->data(), slab_->Chunk(off), size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (__atomic_load_n(slot, __ATOMIC_RELAXED) == entry) {
+            value->size() = size;
             return Ok;
         }
     }
+}
 
-    *value = "aoisodhgghwioghwrghwiwnghreunrwohorenhiohioeraioerhioerjhgwjrnuihgjakwnhgrnwhwrh";
-    return Ok;
+
+/**
+ * 同 Read，查找期间桶的 epoch 变了就重查
+ */
+bool NvmEngine::Contains(const Slice &key) {
+    uint64_t hash = Hash(key.data());
+    bucket &b = buckets_[BucketIndex(hash)];
+    while (true) {
+        uint32_t epoch = b.epoch.load(std::memory_order_acquire);
+        uint32_t entry;
+        bool found = Find(b, hash, key.data(), &entry) != nullptr;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (LIKELY(b.epoch.load(std::memory_order_relaxed) == epoch)) {
+            return found;
+        }
+    }
 }
 
 
-Status NvmEngine::Set(const Slice &key, const Slice &value) {
-    if (++set_count_ % DISPLAY_NUM == 0) {
-        std::lock_guard<std::mutex> lock(log_mut_);
-        PrintLog("[NvmEngine::Set] set count: %u\n", set_count_);
+Status NvmEngine::Get(const Slice &key, std::string *value) {
+    char buf[MAX_VALUE_SIZE];
+    Slice out(buf, MAX_VALUE_SIZE);
+    Status s = Read(key, Hash(key.data()), &out);
+    if (s == Ok) {
+        value->assign(buf, out.size());
     }
+    return s;
+}
 
-    uint16_t index = Hash(key.to_string());
 
-    if (fast_map_[index].size() < FAST_MAP_SIZE) {
-        std::lock_guard<std::mutex> lock(mut_[index]);
-        fast_map_[index][key.to_string()] = value.to_string();
-        return Ok;
+Status NvmEngine::Get(const Slice &key, Slice *value) {
+    return Read(key, Hash(key.data()), value);
+}
+
+
+#ifdef USE_COROUTINE
+/**
+ * 协程版的 Read：算出 hash 后预取起始索引组并挂起，恢复后对 tag 命中的槽预取 PMem 记录再挂起，
+ * 最后在数据已经进入 cache 时走普通的 Read。key 按值传入，SubmitGet 的调用者不必保留 Slice 对象本身
+ */
+lookup_task NvmEngine::ReadTask(Slice key, Slice *value, Status *status) {
+    uint64_t hash = Hash(key.data());
+    bucket &b = buckets_[BucketIndex(hash)];
+    index_group &g = b.index[GroupIndex(hash)];
+    co_await Prefetch(&g);
+
+    uint32_t mask = MatchTag(g, TagByte(hash));
+    if (mask != 0) {
+        uint32_t entry = __atomic_load_n(g.entries + __builtin_ctz(mask), __ATOMIC_ACQUIRE);
+        const char *pair = b.ptr + EntryNo(entry) * PAIR_SIZE;
+        __builtin_prefetch(pair);
+        co_await Prefetch(pair + PAIR_SIZE - 1);
     }
+    *status = Read(key, hash, value);
+}
 
-//    memcpy(buckets_[index].ptr + buckets_[index].end_off, key.data(), KEY_SIZE);
-//    memcpy(buckets_[index].ptr + buckets_[index].end_off + KEY_SIZE, value.data(), VALUE_SIZE);
-//    std::lock_guard<std::mutex> lock(mut_[index]);
-//    buckets_[index].end_off += PAIR_SIZE;
 
-    return Ok;
+/**
+ * 每个 key 一个查找协程，最多 MULTI_BATCH 个同时在途，一个结束就补上下一个 key，
+ * 不像分批版本那样要等一批中最慢的 key
+ */
+void NvmEngine::MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) {
+    Interleave<MULTI_BATCH>(n, [&](size_t i) {
+        return ReadTask(keys[i], &values[i], &statuses[i]);
+    });
 }
 
 
-NvmEngine::~NvmEngine() {
-#ifdef USE_LIBPMEM
-    pmem_unmap(pmem_base_, mapped_size_);
+/**
+ * 新查找进入本线程槽的窗口，窗口满时先推进在途的查找直到空出位置，
+ * 所以一个接一个提交的查找也有最多 DEPTH 个同时在途。
+ * 预取阶段读到的索引项只用来预取，结果都由 Read 在完成时得出，期间同一个 key 被写也没有问题
+ */
+void NvmEngine::SubmitGet(const Slice &key, Slice *value, Status *status) {
+    get_queue &queue = get_queues_[ThreadId()];
+    LockQueue(queue);
+    queue.window.Push(ReadTask(key, value, status).handle);
+    UnlockQueue(queue);
+}
+
+
+void NvmEngine::CompleteGets() {
+    get_queue &queue = get_queues_[ThreadId()];
+    LockQueue(queue);
+    queue.window.Drain();
+    UnlockQueue(queue);
+}
 #else
-    munmap(pmem_base_, mapped_size_);
-#endif
+/**
+ * 分三步处理一批 key，让多个 key 的访存重叠：
+ * 先算出全部 hash 并预取索引槽，再对 tag 命中的槽预取 PMem 记录，最后逐个查找拷贝
+ */
+void NvmEngine::MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) {
+    uint64_t hashes[MULTI_BATCH];
+
+    for (size_t base = 0; base < n; base += MULTI_BATCH) {
+        size_t batch = std::min(n - base, (size_t) MULTI_BATCH);
+
+        for (size_t i = 0; i < batch; ++i) {
+            hashes[i] = Hash(keys[base + i].data());
+            __builtin_prefetch(buckets_[BucketIndex(hashes[i])].index + GroupIndex(hashes[i]));
+        }
+
+        for (size_t i = 0; i < batch; ++i) {
+            PrefetchRecord(hashes[i]);
+        }
+
+        for (size_t i = 0; i < batch; ++i) {
+            statuses[base + i] = Read(keys[base + i], hashes[i], &values[base + i]);
+        }
+    }
+}
 
-    uint64_t size_max = 0;
-    uint64_t size_sum = 0;
-    for (auto &map : fast_map_) {
-        size_sum += map.size();
-        size_max = std::max(size_max, map.size());
+
+/**
+ * 索引组已经预取过，对 tag 命中的槽预取 PMem 记录
+ */
+inline void NvmEngine::PrefetchRecord(uint64_t hash) {
+    bucket &b = buckets_[BucketIndex(hash)];
+    index_group &g = b.index[GroupIndex(hash)];
+    uint32_t mask = MatchTag(g, TagByte(hash));
+    if (mask != 0) {
+        uint32_t entry = __atomic_load_n(g.entries + __builtin_ctz(mask), __ATOMIC_ACQUIRE);
+        const char *pair = b.ptr + EntryNo(entry) * PAIR_SIZE;
+        __builtin_prefetch(pair);
+        __builtin_prefetch(pair + PAIR_SIZE - 1);
+    }
+}
+
+
+/**
+ * 提交时算出 hash 并预取索引组，队列攒满 DEPTH 个后按 MultiGet 的后两步一起完成。
+ * 提交时不读索引项，完成时走 Read，所以排队期间 key 被写等同于 Get 与 Set 并发
+ */
+void NvmEngine::SubmitGet(const Slice &key, Slice *value, Status *status) {
+    get_queue &queue = get_queues_[ThreadId()];
+    LockQueue(queue);
+    uint32_t i = queue.count++;
+    queue.hashes[i] = Hash(key.data());
+    queue.keys[i] = key;
+    queue.values[i] = value;
+    queue.statuses[i] = status;
+    __builtin_prefetch(buckets_[BucketIndex(queue.hashes[i])].index + GroupIndex(queue.hashes[i]));
+    if (queue.count == get_queue::DEPTH) {
+        CompleteQueue(queue);
     }
-    uint64_t size_avg = size_sum / BUCKET_SIZE;
-    PrintLog("fast_map_, size_max = %u\n", size_max);
-    PrintLog("fast_map_, size_avg = %u\n", size_avg);
+    UnlockQueue(queue);
+}
 
-    fclose(log_file_);
+
+void NvmEngine::CompleteGets() {
+    get_queue &queue = get_queues_[ThreadId()];
+    LockQueue(queue);
+    CompleteQueue(queue);
+    UnlockQueue(queue);
+}
+
+
+void NvmEngine::CompleteQueue(get_queue &queue) {
+    for (uint32_t i = 0; i < queue.count; ++i) {
+        PrefetchRecord(queue.hashes[i]);
+    }
+    for (uint32_t i = 0; i < queue.count; ++i) {
+        *queue.statuses[i] = Read(queue.keys[i], queue.hashes[i], queue.values[i]);
+    }
+    queue.count = 0;
+}
+#endif
+
+
+inline void NvmEngine::LockQueue(get_queue &queue) {
+    while (queue.lock.exchange(true, std::memory_order_acquire)) {
+        _mm_pause();
+    }
+}
+
+
+inline void NvmEngine::UnlockQueue(get_queue &queue) {
+    queue.lock.store(false, std::memory_order_release);
+}
+
+
+/**
+ * 进入桶的写者区间。压缩器或检查点线程独占一个桶时会等待写者全部退出，期间新的写者在这里等待。
+ * held 表示当前线程已经在这个桶的写者区间内（MultiSet 中同一批的多个 key 落在同一个桶），
+ * 这时压缩器不可能开始，不能等待，否则与压缩器互相等待
+ */
+inline void NvmEngine::EnterBucket(bucket &b, bool held) {
+    if (held) {
+        b.writers.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    while (true) {
+        b.writers.fetch_add(1, std::memory_order_seq_cst);
+        if (LIKELY(!b.exclusive.load(std::memory_order_seq_cst))) {
+            return;
+        }
+        b.writers.fetch_sub(1, std::memory_order_release);
+        while (b.exclusive.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+
+inline void NvmEngine::LeaveBucket(bucket &b) {
+    b.writers.fetch_sub(1, std::memory_order_release);
+}
+
+
+/**
+ * 独占桶 b：先占住 exclusive（压缩器和检查点线程之间互斥），再等待写者全部退出。
+ * 之后 tail 之前预留的记录都已写出并发布
+ */
+inline void NvmEngine::LockBucket(bucket &b) {
+    bool expected = false;
+    while (!b.exclusive.compare_exchange_weak(expected, true, std::memory_order_seq_cst)) {
+        expected = false;
+        std::this_thread::yield();
+    }
+    while (b.writers.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+    }
+}
+
+
+inline void NvmEngine::UnlockBucket(bucket &b) {
+    b.exclusive.store(false, std::memory_order_release);
+}
+
+
+/**
+ * 为一条记录预留日志空间，环形日志已满返回 false。
+ * 写者最多用到 RECORD_NUM - SEGMENT_RECORD_NUM 条，留出一段给压缩器搬迁存活记录，
+ * 否则桶写满后 head 所在段只要还有存活记录就永远回收不了。
+ * 按 reserved 而不是 tail 计算，异步写已经确认、还在队列中的记录也占着位置
+ */
+inline bool NvmEngine::Admit(bucket &b) {
+    uint64_t head = b.head.load(std::memory_order_acquire);
+    uint64_t reserved = b.reserved.load(std::memory_order_relaxed);
+    do {
+        if (UNLIKELY(reserved - head >= RECORD_NUM - SEGMENT_RECORD_NUM)) {
+            return false;
+        }
+    } while (!b.reserved.compare_exchange_weak(reserved, reserved + 1, std::memory_order_relaxed));
+    return true;
+}
+
+
+/**
+ * 在写者区间内预留空间并取序列号，环形日志已满返回 false
+ */
+inline bool NvmEngine::Reserve(uint64_t hash, uint64_t *seq) {
+    bucket &b = buckets_[BucketIndex(hash)];
+    if (UNLIKELY(!Admit(b))) {
+        return false;
+    }
+    *seq = b.tail.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+
+/**
+ * 桶 b 已满时等待压缩器回收空间，有空位后返回 true，由调用者重新预留。
+ * 必须在写者区间之外调用：压缩器要等写者全部退出才能锁住桶。
+ * 没有压缩器、死记录不到一段（回收不出空间）或者 head 在 SPACE_WAIT_MS 内没有前进时返回 false，写入返回 OutOfMemory。
+ * 等待期间 waiters 非零，压缩器优先且不限速地回收这个桶
+ */
+bool NvmEngine::WaitSpace(bucket &b) {
+    if (compaction_rate_ == 0) {
+        return false;
+    }
+    b.waiters.fetch_add(1, std::memory_order_relaxed);
+    uint64_t head = b.head.load(std::memory_order_acquire);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SPACE_WAIT_MS);
+    bool space = false;
+    while (true) {
+        uint64_t used = b.reserved.load(std::memory_order_relaxed) - head;
+        if (used < RECORD_NUM - SEGMENT_RECORD_NUM) {
+            space = true;
+            break;
+        }
+        if (used < b.live.load(std::memory_order_relaxed) + SEGMENT_RECORD_NUM ||
+            std::chrono::steady_clock::now() > deadline) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        uint64_t now_head = b.head.load(std::memory_order_acquire);
+        if (now_head != head) {
+            head = now_head;
+            deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SPACE_WAIT_MS);
+        }
+    }
+    b.waiters.fetch_sub(1, std::memory_order_relaxed);
+    return space;
+}
+
+
+/**
+ * 记录先在栈上拼好并计算校验和，再整条用非临时写落盘（桶起始 256 字节对齐，记录 96 字节，天然 32 字节对齐），
+ * 然后写记录头。两者之间不需要 fence：记录头先于记录落盘时，恢复会因为校验和不符而跳过这条记录
+ */
+inline void NvmEngine::WriteRecord(uint64_t hash, uint64_t seq, const Slice &key, const char *value, uint8_t type) {
+    bucket &b = buckets_[BucketIndex(hash)];
+    uint64_t no = seq % RECORD_NUM;
+    char *pair = b.ptr + no * PAIR_SIZE;
+    char record[PAIR_SIZE] __attribute__((aligned(32)));
+    memcpy(record, key.data(), KEY_SIZE);
+    memcpy(record + KEY_SIZE, value, VALUE_SIZE);
+    CopyNoDrain(pair, record, PAIR_SIZE, durability_ != DurabilityRelaxed);
+    b.headers[no] = MakeHeader(record, seq, type);
+    FlushWrite(b.headers + no, sizeof(record_header));
+
+    //  记录头单独占用一次 XPLine 写
+    engine_stat &stat = Stat();
+    Add(stat.user_bytes, PAIR_SIZE);
+    Add(stat.media_bytes, (XPLineCount(pair, PAIR_SIZE) + 1) * XPLINE_SIZE);
+}
+
+
+inline record_header NvmEngine::MakeHeader(const char *pair, uint64_t seq, uint8_t type) {
+    record_header header;
+    header.meta = (uint32_t) (seq << 2) | type;
+    header.crc = crc32c_extend(crc32c(pair, PAIR_SIZE), &header.meta, sizeof(header.meta));
+    return header;
+}
+
+
+/**
+ * 恢复时检查记录号 no 上序列号为 seq 的记录是否完整：记录头的类型、序列号和校验和都要匹配
+ */
+inline bool NvmEngine::CheckRecord(bucket &b, uint64_t no, uint64_t seq) {
+    record_header header = b.headers[no];
+    uint8_t type = header.meta & 3;
+    if (type != VALID_INLINE && type != VALID_INDIRECT) {
+        return false;
+    }
+    record_header expected = MakeHeader(b.ptr + no * PAIR_SIZE, seq, type);
+    return header.meta == expected.meta && header.crc == expected.crc;
+}
+
+
+/**
+ * 变长 value 的 chunk 是否与记录中的校验和一致。不一致的可能是没有完整落盘的 chunk，
+ * 也可能是旧版本的 chunk 已被释放复用，两种情况都不能采用这条记录
+ */
+inline bool NvmEngine::CheckChunk(const char *pair) {
+    const value_desc *desc = (const value_desc *) (pair + KEY_SIZE);
+    return slab_ != nullptr && desc->size <= MAX_VALUE_SIZE &&
+           crc32c(slab_->Chunk(desc->off), desc->size) == desc->crc;
+}
+
+
+inline void NvmEngine::Commit(uint64_t hash, uint64_t seq, const Slice &key, const Slice &value, bool indirect) {
+    bucket &b = buckets_[BucketIndex(hash)];
+    uint32_t stale = Publish(b, hash, key.data(), seq, indirect);
+    if (stale == 0) {
+        b.live.fetch_add(1, std::memory_order_relaxed);
+    } else if (EntryIndirect(stale)) {
+        const value_desc *desc = Descriptor(b, stale);
+        slab_->Free(desc->off, SlabAllocator::SizeClass(desc->size));
+    }
+    if (cache_) {
+        if (!indirect) {
+            cache_->Update(hash, key.data(), value.data(), seq);
+        } else {
+            cache_->Invalidate(hash, key.data());
+        }
+    }
+}
+
+
+/**
+ * 长度不是 VALUE_SIZE 的 value 写到 slab chunk 中，记录里只保存 value_desc，
+ * 记录头类型为 VALID_INDIRECT。value_desc 中带有 chunk 的校验和，chunk 没有完整落盘时恢复会跳过这条记录
+ */
+inline Status NvmEngine::SetIndirect(uint64_t hash, const Slice &key, const Slice &value, bool held) {
+    uint32_t cls = SlabAllocator::SizeClass(value.size());
+    if (slab_ == nullptr || cls == SlabAllocator::CLASS_NUM) {
+        return OutOfMemory;
+    }
+    uint64_t off = slab_->Allocate(cls);
+    if (off == 0) {
+        return OutOfMemory;
+    }
+    bucket &b = buckets_[BucketIndex(hash)];
+    uint64_t seq;
+    EnterBucket(b, held);
+    while (UNLIKELY(!Reserve(hash, &seq))) {
+        //  held 时本线程还在这个桶的写者区间内，压缩器无法开始，不能等待
+        LeaveBucket(b);
+        if (held || !WaitSpace(b)) {
+            slab_->Free(off, cls);
+            return OutOfMemory;
+        }
+        EnterBucket(b, false);
+    }
+
+    char *chunk = slab_->Chunk(off);
+    memcpy(chunk, value.data(), value.size());
+    FlushWrite(chunk, value.size());
+    //  记录本身在 WriteRecord 中统计
+    engine_stat &stat = Stat();
+    Add(stat.user_bytes, value.size());
+    Add(stat.media_bytes, XPLineCount(chunk, value.size()) * XPLINE_SIZE);
+
+    value_desc desc[VALUE_SIZE / sizeof(value_desc)] = {};
+    desc[0].off = off;
+    desc[0].size = (uint32_t) value.size();
+    desc[0].crc = crc32c(value.data(), value.size());
+    WriteRecord(hash, seq, key, (const char *) desc, VALID_INDIRECT);
+    EndWrite(1);
+    Commit(hash, seq, key, value, true);
+    LeaveBucket(b);
+    return Ok;
+}
+
+
+/**
+ * 记录和记录头一起写出并持久化，再发布到索引。
+ * DurabilityStrict 下 Get 看到的一定是已落盘的数据，其他级别见 EndWrite
+ */
+Status NvmEngine::Set(const Slice &key, const Slice &value) {
+    engine_stat &stat = Stat();
+    Add(stat.sets);
+    uint64_t hash = Hash(key.data());
+    if (flusher_num_ > 0) {
+        WriteRing &ring = Ring(hash);
+        if (LIKELY(value.size() == VALUE_SIZE)) {
+            //  确认之前先预留日志空间，入队的记录写出时不会因为桶满失败
+            bucket &b = buckets_[BucketIndex(hash)];
+            while (UNLIKELY(!Admit(b))) {
+                if (!WaitSpace(b)) {
+                    Add(stat.set_failures);
+                    return OutOfMemory;
+                }
+            }
+            Enqueue(ring, hash, key.data(), value.data());
+            return Ok;
+        }
+        //  变长 value 同步写，先等之前排队的记录写完，否则排队的旧值之后会覆盖这次写入
+        WaitRing(ring);
+    }
+    if (in_place_ && value.size() == VALUE_SIZE && UpdateInPlace(hash, key, value)) {
+        return Ok;
+    }
+    Status s = Append(hash, key, value);
+    if (UNLIKELY(s != Ok)) {
+        Add(stat.set_failures);
+    }
+    return s;
+}
+
+
+/**
+ * 同步追加一条记录。桶满时退出写者区间，等压缩器回收空间后重试（见 WaitSpace）
+ */
+inline Status NvmEngine::Append(uint64_t hash, const Slice &key, const Slice &value) {
+    if (UNLIKELY(value.size() != VALUE_SIZE)) {
+        return SetIndirect(hash, key, value);
+    }
+    bucket &b = buckets_[BucketIndex(hash)];
+    uint64_t seq;
+    EnterBucket(b, false);
+    while (UNLIKELY(!Reserve(hash, &seq))) {
+        LeaveBucket(b);
+        if (!WaitSpace(b)) {
+            return OutOfMemory;
+        }
+        EnterBucket(b, false);
+    }
+
+    WriteRecord(hash, seq, key, value.data(), VALID_INLINE);
+    EndWrite(1);
+    Commit(hash, seq, key, value, false);
+    LeaveBucket(b);
+    return Ok;
+}
+
+
+/**
+ * 与 Set 的持久化顺序相同，但一批记录共用一次 sfence（或者在 EndWrite 中按组计数），
+ * 同时预取发布时要写的索引槽
+ */
+void NvmEngine::MultiSet(size_t n, const Slice *keys, const Slice *values, Status *statuses) {
+    if (flusher_num_ > 0 || in_place_) {
+        for (size_t i = 0; i < n; ++i) {
+            statuses[i] = Set(keys[i], values[i]);
+        }
+        return;
+    }
+    for (size_t base = 0; base < n; base += MULTI_BATCH) {
+        size_t batch = std::min(n - base, (size_t) MULTI_BATCH);
+        WriteBatch(batch, keys + base, values + base, statuses + base);
+
+        //  WriteBatch 持有多个桶时不能等待压缩器，失败的 key 按顺序逐个同步重试。
+        //  同一批中后面的同一个 key 已经写成功时，这次写入按顺序本就会被覆盖，直接算成功
+        uint64_t failures = 0;
+        for (size_t i = base; i < base + batch; ++i) {
+            if (statuses[i] == Ok) {
+                continue;
+            }
+            bool superseded = false;
+            for (size_t j = i + 1; j < base + batch && !superseded; ++j) {
+                superseded = statuses[j] == Ok && memcmp(keys[i].data(), keys[j].data(), KEY_SIZE) == 0;
+            }
+            statuses[i] = superseded ? Ok : Append(Hash(keys[i].data()), keys[i], values[i]);
+            failures += statuses[i] != Ok;
+        }
+        engine_stat &stat = Stat();
+        Add(stat.sets, batch);
+        Add(stat.set_failures, failures);
+    }
+}
+
+
+/**
+ * 写一批不超过 MULTI_BATCH 个 key，不计入 sets 统计。MultiSet 和异步写的刷写线程共用，
+ * admitted 表示入队时已经用 Admit 预留了空间，只取序列号
+ */
+void NvmEngine::WriteBatch(size_t batch, const Slice *k, const Slice *v, Status *statuses, bool admitted) {
+    uint64_t hashes[MULTI_BATCH];
+    uint64_t seqs[MULTI_BATCH];
+    bool pending[MULTI_BATCH];
+
+    //  变长 value 直接走 SetIndirect，后面两步跳过（pending 为 false）
+    for (size_t i = 0; i < batch; ++i) {
+        hashes[i] = Hash(k[i].data());
+        bool held = false;
+        for (size_t j = 0; j < i; ++j) {
+            held |= pending[j] && BucketIndex(hashes[j]) == BucketIndex(hashes[i]);
+        }
+        pending[i] = v[i].size() == VALUE_SIZE;
+        if (UNLIKELY(!pending[i])) {
+            statuses[i] = SetIndirect(hashes[i], k[i], v[i], held);
+            continue;
+        }
+        bucket &b = buckets_[BucketIndex(hashes[i])];
+        __builtin_prefetch(b.index + GroupIndex(hashes[i]), 1);
+        EnterBucket(b, held);
+        if (admitted) {
+            seqs[i] = b.tail.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            pending[i] = Reserve(hashes[i], seqs + i);
+        }
+        if (!pending[i]) {
+            LeaveBucket(b);
+        }
+        statuses[i] = pending[i] ? Ok : OutOfMemory;
+    }
+
+    uint64_t written = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        if (pending[i]) {
+            WriteRecord(hashes[i], seqs[i], k[i], v[i].data(), VALID_INLINE);
+            ++written;
+        }
+    }
+    EndWrite(written);
+
+    for (size_t i = 0; i < batch; ++i) {
+        if (pending[i]) {
+            Commit(hashes[i], seqs[i], k[i], v[i], false);
+            LeaveBucket(buckets_[BucketIndex(hashes[i])]);
+        }
+    }
+}
+
+
+/**
+ * key 已有定长 value 时原地覆盖原记录的 value 和记录头，不占用新的日志空间。
+ * 写者之间用记录的版本号互斥，奇数表示正在写，读者发现版本变化就重读（见 Read）。
+ * 非临时写不与之后的普通写排序，恢复版本号之前要 sfence，否则读者可能在新值可见之前看到偶数版本。
+ * 缓存也在持有版本时更新，两个写者的缓存更新顺序与写 PMem 的顺序一致。
+ * 返回 false 表示 key 不存在、value 在 slab 中或刚被追加写替换，由调用者追加写
+ */
+inline bool NvmEngine::UpdateInPlace(uint64_t hash, const Slice &key, const Slice &value) {
+    bucket &b = buckets_[BucketIndex(hash)];
+    EnterBucket(b, false);
+    uint32_t entry;
+    uint32_t *slot = Find(b, hash, key.data(), &entry);
+    if (slot == nullptr || EntryIndirect(entry)) {
+        LeaveBucket(b);
+        return false;
+    }
+    uint64_t no = EntryNo(entry);
+    std::atomic<uint32_t> &version = Version(b, no);
+    uint32_t v = version.load(std::memory_order_relaxed);
+    while ((v & 1) || !version.compare_exchange_weak(v, v + 1, std::memory_order_acquire)) {
+        _mm_pause();
+        v = version.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    if (UNLIKELY(__atomic_load_n(slot, __ATOMIC_ACQUIRE) != entry)) {
+        version.store(v, std::memory_order_release);
+        LeaveBucket(b);
+        return false;
+    }
+
+    uint64_t seq = Sequence(b, no);
+    WriteRecord(hash, seq, key, value.data(), VALID_INLINE);
+    EndWrite(1);
+    _mm_sfence();
+    if (cache_) {
+        cache_->Update(hash, key.data(), value.data(), seq);
+    }
+    version.store(v + 2, std::memory_order_release);
+    LeaveBucket(b);
+    return true;
+}
+
+
+/**
+ * 记录 no 的版本号。版本号按桶和记录号轮流共用，共用只会让读者多重试，不影响正确性
+ */
+inline std::atomic<uint32_t> &NvmEngine::Version(bucket &b, uint64_t no) {
+    return versions_[((&b - buckets_) * RECORD_NUM + no) & (VERSION_NUM - 1)];
+}
+
+
+/**
+ * key 所在的桶固定由一个刷写线程负责，同一个 key 的写入都经过同一个先进先出的队列
+ */
+inline WriteRing &NvmEngine::Ring(uint64_t hash) {
+    return *rings_[BucketIndex(hash) % flusher_num_];
+}
+
+
+/**
+ * 把一条记录放进队列，队列满时等待刷写线程。入队的顺序就是这个 key 写到 PMem 的顺序：
+ * 一个 Set 返回之后才开始的 Set 一定排在它后面，最后写出的是后者
+ */
+inline void NvmEngine::Enqueue(WriteRing &ring, uint64_t hash, const char *key, const char *value) {
+    ring.Lock();
+    if (UNLIKELY(!ring.TryPush(hash, key, value))) {
+        async_waits_.fetch_add(1, std::memory_order_relaxed);
+        do {
+            ring.Unlock();
+            std::this_thread::yield();
+            ring.Lock();
+        } while (!ring.TryPush(hash, key, value));
+    }
+    ring.Unlock();
+}
+
+
+/**
+ * 等待调用时已经在队列中的记录写完，之后入队的不用等
+ */
+inline void NvmEngine::WaitRing(WriteRing &ring) {
+    uint64_t head = ring.Head();
+    while (!ring.Drained(head)) {
+        std::this_thread::yield();
+    }
+}
+
+
+/**
+ * 刷写线程 id 负责第 id 个队列，每次取一批写到 PMem，同一时刻写介质的线程数不超过 flusher_num_。
+ * 关闭时先置 flush_stop_，置位之后一次没有取到记录才退出，保证关闭前入队的记录都已写出
+ */
+void NvmEngine::FlushLoop(uint32_t id) {
+    WriteRing &ring = *rings_[id];
+    while (true) {
+        bool stopping = flush_stop_.load(std::memory_order_acquire);
+        if (DrainRing(ring) == 0) {
+            if (stopping) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    }
+}
+
+
+/**
+ * 取出一批记录写到 PMem，发布到索引之后才出队，返回写出的条数。
+ * 入队前已经预留了日志空间，写入不会失败；同一批中同一个 key 按入队顺序写，后写的覆盖先写的
+ */
+uint64_t NvmEngine::DrainRing(WriteRing &ring) {
+    uint64_t begin;
+    uint64_t n = ring.Peek(MULTI_BATCH, &begin);
+    if (n == 0) {
+        return 0;
+    }
+    Slice keys[MULTI_BATCH];
+    Slice values[MULTI_BATCH];
+    Status statuses[MULTI_BATCH];
+    for (uint64_t i = 0; i < n; ++i) {
+        keys[i] = Slice((char *) ring.Key(begin + i), KEY_SIZE);
+        values[i] = Slice((char *) ring.Value(begin + i), VALUE_SIZE);
+    }
+    WriteBatch(n, keys, values, statuses, true);
+    ring.Pop(n);
+    async_flushed_.fetch_add(n, std::memory_order_relaxed);
+    return n;
+}
+
+
+/**
+ * 后台压缩线程：有写者在 WaitSpace 中等待的桶优先，不限速地回收；
+ * 否则挑死记录比例最高的桶回收它最旧的一段日志，按 compaction_rate_ 限制搬迁带宽，搬迁 n 字节之后至少休眠 n / rate 秒。
+ * 环形日志只能从 head 回收，一段中存活的记录搬到 tail 后仍要逐段推进到死记录所在的位置，
+ * 一个桶转一圈搬迁的是全部存活记录、回收的是全部死记录，所以按 dead / used 而不是按 head 段的内容选桶
+ */
+void NvmEngine::CompactLoop() {
+    while (!stop_.load(std::memory_order_relaxed)) {
+        bucket *victim = nullptr;
+        bool victim_urgent = false;
+        uint64_t victim_dead = 0, victim_used = 1;
+        for (auto &b : buckets_) {
+            uint64_t used = b.tail.load(std::memory_order_relaxed) - b.head.load(std::memory_order_relaxed);
+            uint64_t live = b.live.load(std::memory_order_relaxed);
+            uint64_t dead = used > live ? used - live : 0;
+            bool urgent = b.waiters.load(std::memory_order_relaxed) > 0;
+            if (dead < SEGMENT_RECORD_NUM || (!urgent && used < COMPACT_TRIGGER)) {
+                continue;
+            }
+            if (victim == nullptr || urgent > victim_urgent ||
+                (urgent == victim_urgent && dead * victim_used > victim_dead * used)) {
+                victim = &b;
+                victim_urgent = urgent;
+                victim_dead = dead;
+                victim_used = used;
+            }
+        }
+        if (victim == nullptr) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        uint64_t bytes = 0;
+        if (!CompactSegment(*victim, &bytes)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        } else if (bytes > 0 && !victim_urgent) {
+            std::this_thread::sleep_for(std::chrono::microseconds(bytes * 1000000 / compaction_rate_));
+        }
+    }
+}
+
+
+/**
+ * 回收桶 b 从 head 开始的一段（最多 SEGMENT_RECORD_NUM 条）记录：
+ * 仍被索引引用的记录追加到 tail 并持久化，再切换索引；
+ * 之后增加 epoch 让持有旧位置的读者重读，清除这一段的有效标记，最后持久化新的 head。
+ * 任意一步崩溃，恢复时都能按序列号得到正确的最新版本。
+ * bytes 返回搬迁的字节数，空间不足以搬迁时放弃并返回 false
+ */
+bool NvmEngine::CompactSegment(bucket &b, uint64_t *bytes) {
+    LockBucket(b);
+
+    uint64_t head = b.head.load(std::memory_order_relaxed);
+    uint64_t tail = b.tail.load(std::memory_order_relaxed);
+    //  一段不跨越环形日志的末尾，有效标记可以一次清除
+    uint64_t end = std::min(std::min(head + SEGMENT_RECORD_NUM, tail), head - head % RECORD_NUM + RECORD_NUM);
+
+    std::vector<uint32_t *> slots;
+    std::vector<uint64_t> nos;
+    for (uint64_t seq = head; seq < end; ++seq) {
+        uint64_t no = seq % RECORD_NUM;
+        if (b.headers[no].meta == 0) {
+            continue;
+        }
+        const char *pair = b.ptr + no * PAIR_SIZE;
+        uint32_t entry;
+        uint32_t *slot = Find(b, Hash(pair), pair, &entry);
+        if (slot != nullptr && EntryNo(entry) == no) {
+            slots.push_back(slot);
+            nos.push_back(no);
+        }
+    }
+    if (tail + nos.size() - head > RECORD_NUM) {
+        UnlockBucket(b);
+        return false;
+    }
+
+    engine_stat &stat = Stat();
+    for (size_t i = 0; i < nos.size(); ++i) {
+        char *pair = b.ptr + (tail + i) % RECORD_NUM * PAIR_SIZE;
+        CopyNoDrain(pair, b.ptr + nos[i] * PAIR_SIZE, PAIR_SIZE);
+        Add(stat.media_bytes, (XPLineCount(pair, PAIR_SIZE) + 1) * XPLINE_SIZE);
+    }
+    Drain();
+    for (size_t i = 0; i < nos.size(); ++i) {
+        uint64_t no = (tail + i) % RECORD_NUM;
+        b.headers[no] = MakeHeader(b.ptr + no * PAIR_SIZE, tail + i, b.headers[nos[i]].meta & 3);
+        Flush(b.headers + no, sizeof(record_header));
+    }
+    Drain();
+    for (size_t i = 0; i < nos.size(); ++i) {
+        uint32_t entry = __atomic_load_n(slots[i], __ATOMIC_RELAXED);
+        __atomic_store_n(slots[i], MakeEntry(EntryTag(entry), EntryIndirect(entry), (tail + i) % RECORD_NUM),
+                         __ATOMIC_RELEASE);
+    }
+    b.tail.store(tail + nos.size(), std::memory_order_relaxed);
+    b.reserved.fetch_add(nos.size(), std::memory_order_relaxed);
+
+    b.epoch.fetch_add(1, std::memory_order_seq_cst);
+    memset(b.headers + head % RECORD_NUM, 0, (end - head) * sizeof(record_header));
+    Persist(b.headers + head % RECORD_NUM, (end - head) * sizeof(record_header));
+    *b.head_ptr = end;
+    Persist(b.head_ptr, sizeof(uint64_t));
+    b.head.store(end, std::memory_order_release);
+    UnlockBucket(b);
+
+    compacted_segments_.fetch_add(1, std::memory_order_relaxed);
+    compacted_bytes_.fetch_add(nos.size() * PAIR_SIZE, std::memory_order_relaxed);
+    *bytes = nos.size() * PAIR_SIZE;
+    return true;
+}
+
+
+/**
+ * 后台检查点线程：每 period_sec 秒为上次检查点之后有变化的桶写一次检查点
+ */
+void NvmEngine::CheckpointLoop(uint32_t period_sec) {
+    std::vector<checkpoint_entry> buffer;
+    auto next = std::chrono::steady_clock::now() + std::chrono::seconds(period_sec);
+    while (!stop_.load(std::memory_order_relaxed)) {
+        if (std::chrono::steady_clock::now() < next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        for (auto &b : buckets_) {
+            if (stop_.load(std::memory_order_relaxed)) {
+                break;
+            }
+            CheckpointBucket(b, buffer);
+        }
+        next = std::chrono::steady_clock::now() + std::chrono::seconds(period_sec);
+    }
+}
+
+
+/**
+ * 把桶 b 的索引写成检查点，上次检查点之后没有变化时跳过。
+ * 独占桶时按槽位顺序收集非空的索引项，这时索引正好对应序列号在 [head, tail) 内的全部记录；
+ * 非 DurabilityStrict 下写路径没有等待落盘，还要在独占期间刷出上次检查点之后的记录、记录头和 chunk。
+ * 释放桶之后再写 PMem：检查点项和检查点头由同一个校验和保护，写到一半崩溃时恢复退回全量扫描这个桶。
+ * 检查点只有一份，就地覆盖，buffer 是调用者复用的缓冲区
+ */
+void NvmEngine::CheckpointBucket(bucket &b, std::vector<checkpoint_entry> &buffer) {
+    if (b.checkpoint_valid && b.head.load(std::memory_order_relaxed) == b.checkpoint_head &&
+        b.tail.load(std::memory_order_relaxed) == b.checkpoint_tail) {
+        return;
+    }
+
+    LockBucket(b);
+    checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    header.head = b.head.load(std::memory_order_relaxed);
+    header.tail = b.tail.load(std::memory_order_relaxed);
+    buffer.clear();
+    for (uint64_t group = 0; group < INDEX_GROUP_NUM; ++group) {
+        const index_group &g = b.index[group];
+        for (uint32_t i = 0; i < GROUP_SLOT_NUM; ++i) {
+            if (g.entries[i] != 0) {
+                uint32_t overflow = (g.overflow >> i) & 1;
+                uint32_t slot = (uint32_t) (group * GROUP_SLOT_NUM + i);
+                buffer.push_back({(slot << 8) | (overflow << 7) | (g.tags[i] & 0x7f), g.entries[i]});
+            }
+        }
+    }
+    if (durability_ != DurabilityStrict) {
+        FlushLog(b, std::max(b.checkpoint_tail, header.head), header.tail);
+    }
+    UnlockBucket(b);
+
+    //  非临时写按 32 字节对齐，多出的检查点项不计入 count 和校验和
+    header.count = (uint32_t) buffer.size();
+    header.crc = CheckpointCrc(header, buffer.data());
+    buffer.resize((buffer.size() + 3) / 4 * 4, checkpoint_entry{0, 0});
+    size_t size = buffer.size() * sizeof(checkpoint_entry);
+    CopyNoDrain((char *) b.checkpoint_entries, (const char *) buffer.data(), size);
+    CopyNoDrain((char *) b.checkpoint, (const char *) &header, sizeof(header));
+    Drain();
+
+    b.checkpoint_head = header.head;
+    b.checkpoint_tail = header.tail;
+    b.checkpoint_valid = true;
+    Add(Stat().media_bytes, XPLineCount(b.checkpoint, sizeof(header) + size) * XPLINE_SIZE);
+    checkpoints_.fetch_add(1, std::memory_order_relaxed);
+    checkpoint_bytes_.fetch_add(sizeof(header) + size, std::memory_order_relaxed);
+}
+
+
+/**
+ * 刷出序列号在 [begin, end) 内的记录、记录头和变长 value 的 chunk，并等待落盘。
+ * 环形日志跨越末尾时分两段刷出
+ */
+void NvmEngine::FlushLog(bucket &b, uint64_t begin, uint64_t end) {
+    if (begin >= end) {
+        return;
+    }
+    uint64_t first = begin % RECORD_NUM;
+    uint64_t count = std::min(end - begin, RECORD_NUM - first);
+    Flush(b.ptr + first * PAIR_SIZE, count * PAIR_SIZE);
+    Flush(b.headers + first, count * sizeof(record_header));
+    if (count < end - begin) {
+        Flush(b.ptr, (end - begin - count) * PAIR_SIZE);
+        Flush(b.headers, (end - begin - count) * sizeof(record_header));
+    }
+    if (slab_) {
+        for (uint64_t seq = begin; seq < end; ++seq) {
+            uint64_t no = seq % RECORD_NUM;
+            if ((b.headers[no].meta & 3) == VALID_INDIRECT) {
+                const value_desc *desc = (const value_desc *) (b.ptr + no * PAIR_SIZE + KEY_SIZE);
+                Flush(slab_->Chunk(desc->off), desc->size);
+            }
+        }
+    }
+    Drain();
+}
+
+
+/**
+ * 检查点中记录号 no 对应的序列号
+ */
+inline uint64_t NvmEngine::CheckpointSequence(const checkpoint_header &header, uint64_t no) {
+    return header.head + (no + RECORD_NUM - header.head % RECORD_NUM) % RECORD_NUM;
+}
+
+
+inline uint32_t NvmEngine::CheckpointCrc(const checkpoint_header &header, const checkpoint_entry *entries) {
+    uint32_t crc = crc32c(&header.count, offsetof(checkpoint_header, padding) - offsetof(checkpoint_header, count));
+    return crc32c_extend(crc, entries, header.count * sizeof(checkpoint_entry));
+}
+
+
+bucket_skew NvmEngine::BucketSkew() const {
+    bucket_skew skew;
+    skew.live_max = 0;
+    double live_sum = 0;
+    double live_square_sum = 0;
+    for (auto &bucket : buckets_) {
+        uint64_t live = bucket.live.load(std::memory_order_relaxed);
+        skew.live_max = std::max(skew.live_max, live);
+        live_sum += live;
+        live_square_sum += (double) live * live;
+    }
+    skew.live_avg = live_sum / BUCKET_NUM;
+    double live_stddev = std::sqrt(std::max(0.0, live_square_sum / BUCKET_NUM - skew.live_avg * skew.live_avg));
+    skew.max_ratio = skew.live_avg > 0 ? skew.live_max / skew.live_avg : 0.0;
+    skew.stddev_ratio = skew.live_avg > 0 ? live_stddev / skew.live_avg : 0.0;
+    return skew;
+}
+
+
+double NvmEngine::Skew() const {
+    return BucketSkew().max_ratio;
+}
+
+
+uint64_t NvmEngine::LiveKeys() const {
+    uint64_t n = 0;
+    for (auto &bucket : buckets_) {
+        n += bucket.live.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+
+/**
+ * 所有统计的可读形式，作为分片使用时每行带上节点号
+ */
+std::string NvmEngine::StatsString() {
+    bucket_skew skew = BucketSkew();
+    uint64_t tail_max = 0;
+    uint64_t tail_sum = 0;
+    for (auto &bucket : buckets_) {
+        uint64_t tail = bucket.tail.load(std::memory_order_relaxed) - bucket.head.load(std::memory_order_relaxed);
+        tail_sum += tail;
+        tail_max = std::max(tail_max, tail);
+    }
+
+    char prefix[32] = "";
+    if (node_ >= 0) {
+        snprintf(prefix, sizeof(prefix), "node %d ", node_);
+    }
+    char buf[1024];
+    int len = snprintf(
+            buf, sizeof(buf),
+            "%sbucket, tail_max = %lu, tail_avg = %lu\n"
+            "%sbucket, live_max = %lu, live_avg = %.2lf, max/avg = %.4lf, stddev/avg = %.4lf\n"
+            "%scompaction, segments = %lu, relocated_bytes = %lu\n"
+            "%scheckpoint, buckets = %lu, bytes = %lu\n",
+            prefix, tail_max, tail_sum / BUCKET_NUM,
+            prefix, skew.live_max, skew.live_avg, skew.max_ratio, skew.stddev_ratio,
+            prefix, compacted_segments_.load(std::memory_order_relaxed),
+            compacted_bytes_.load(std::memory_order_relaxed),
+            prefix, checkpoints_.load(std::memory_order_relaxed), checkpoint_bytes_.load(std::memory_order_relaxed));
+    std::string stats = OpsString(prefix) + std::string(buf, std::min((size_t) len, sizeof(buf) - 1)) +
+                        IndexString(prefix, BUCKET_NUM * RECORD_NUM);
+    if (cache_) {
+        uint64_t hits = cache_->Hits();
+        uint64_t misses = cache_->Misses();
+        snprintf(buf, sizeof(buf), "%sread cache, capacity = %lu, hits = %lu, misses = %lu, hit ratio = %.4lf\n",
+                 prefix, cache_->Capacity(), hits, misses, hits + misses ? (double) hits / (hits + misses) : 0.0);
+        stats += buf;
+    }
+    if (slab_) {
+        snprintf(buf, sizeof(buf), "%sslab, used_pages = %lu\n", prefix, slab_->UsedPages());
+        stats += buf;
+    }
+    if (flusher_num_ > 0) {
+        snprintf(buf, sizeof(buf), "%sasync, flushers = %u, flushed = %lu, full_waits = %lu\n", prefix, flusher_num_,
+                 async_flushed_.load(std::memory_order_relaxed), async_waits_.load(std::memory_order_relaxed));
+        stats += buf;
+    }
+    return stats;
+}
+
+
+/**
+ * 读缓存的计数只有桶布局有，其余属性见 PmemEngine::GetProperty
+ */
+bool NvmEngine::GetProperty(const std::string &property, std::string *value) {
+    if (property == "nvm.cache-hits") {
+        *value = std::to_string(cache_ ? cache_->Hits() : 0);
+        return true;
+    }
+    if (property == "nvm.cache-misses") {
+        *value = std::to_string(cache_ ? cache_->Misses() : 0);
+        return true;
+    }
+    return PmemEngine::GetProperty(property, value);
+}
+
+
+/**
+ * 后台统计线程：每 period_sec 秒把统计写入日志。
+ * 读写路径不再写日志，只更新本线程的计数槽，log_mut_ 只在这里持有
+ */
+void NvmEngine::DumpLoop(uint32_t period_sec) {
+    auto next = std::chrono::steady_clock::now() + std::chrono::seconds(period_sec);
+    while (!stop_.load(std::memory_order_relaxed)) {
+        if (std::chrono::steady_clock::now() < next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        next += std::chrono::seconds(period_sec);
+        std::string stats = StatsString();
+        std::lock_guard<std::mutex> lock(log_mut_);
+        PrintLog("%s", stats.c_str());
+    }
+}
+
+
+NvmEngine::~NvmEngine() {
+    //  先写完异步队列，这时压缩器还在运行，可以为写满的桶回收空间
+    flush_stop_.store(true, std::memory_order_release);
+    for (auto &flusher : flushers_) {
+        flusher.join();
+    }
+    for (auto ring : rings_) {
+        delete ring;
+    }
+#ifdef USE_COROUTINE
+    //  调用者应当已经用 CompleteGets 完成了全部查找，剩下的不再恢复，只释放协程帧
+    for (auto &queue : get_queues_) {
+        queue.window.Clear();
+    }
+#endif
+
+    stop_.store(true, std::memory_order_relaxed);
+    if (compactor_.joinable()) {
+        compactor_.join();
+    }
+    if (dumper_.joinable()) {
+        dumper_.join();
+    }
+    if (checkpointer_.joinable()) {
+        checkpointer_.join();
+    }
+
+    if (durability_ == DurabilityRelaxed) {
+        PersistAll();
+    } else {
+        Drain();
+    }
+    //  关闭时为所有有变化的桶写检查点，下次打开不需要重放
+    if (checkpoint_period_sec_ > 0) {
+        ForEachBucket([this](bucket &b) {
+            thread_local std::vector<checkpoint_entry> buffer;
+            CheckpointBucket(b, buffer);
+        });
+    }
+
+    std::string stats = StatsString();
+    PrintLog("%s", stats.c_str());
+
+    if (cache_) {
+        delete cache_;
+    }
+    if (slab_) {
+        delete slab_;
+    }
+    delete[] versions_;
+
+    if (node_ < 0) {
+        fclose(log_file_);
+    }
 }
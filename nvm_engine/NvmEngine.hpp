@@ -8,53 +8,326 @@
 #ifndef TAIR_CONTEST_KV_CONTEST_NVM_ENGINE_H_
 #define TAIR_CONTEST_KV_CONTEST_NVM_ENGINE_H_
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <functional>
+#include <vector>
 #include "Statement.hpp"
+#include "PmemEngine.hpp"
+#include "XPLine.hpp"
+#include "IndexGroup.hpp"
+#include "KeyHash.hpp"
+#include "ReadCache.hpp"
+#include "SlabAllocator.hpp"
+#include "WriteRing.hpp"
+#include "Coroutine.hpp"
 
 
+/**
+ * 每条记录的记录头，8 字节对齐，整体一次写入，掉电时不会只落盘一半。
+ * meta = (序列号低 30 位 << 2) | 类型（VALID_INLINE / VALID_INDIRECT），全 0 表示空位。
+ * crc 是 key、value 和 meta 的 CRC32C，恢复时据此识别写了一半的记录
+ */
+struct record_header {
+    uint32_t crc;
+    uint32_t meta;
+};
+
+
+/**
+ * 检查点头，独占一个 cache line。crc 是 count、head、tail 和全部检查点项的 CRC32C，
+ * 检查点只覆盖序列号在 [head, tail) 内的记录
+ */
+struct checkpoint_header {
+    uint32_t crc;
+    uint32_t count;     //  检查点项数量
+    uint64_t head;
+    uint64_t tail;
+    char padding[40];
+};
+
+
+/**
+ * 检查点中的一个索引项：slot = (槽位号 << 8) | (溢出位 << 7) | tag 字节的低 7 位，
+ * 槽位号 = 组号 * GROUP_SLOT_NUM + 组内位置，entry 是索引项本身（tag 和记录号）。
+ * 恢复时原样放回同一个槽位，不需要读记录、重新计算 hash 和探测
+ */
+struct checkpoint_entry {
+    uint32_t slot;
+    uint32_t entry;
+};
+
+
+/**
+ * 每个桶是 PMem 上的一段环形追加写日志，只放 key-value 记录；每条记录的记录头、索引检查点和持久化的 head
+ * 放在文件中记录区之后的元数据区，每个桶一段，这样记录区的容量不被元数据挤占。序列号 seq 单调递增，记录号 no = seq % RECORD_NUM，
+ * [head, tail) 之外的位置记录头为 0，可以复用。
+ * 写者通过 tail 的 CAS 预留序列号，记录和记录头一起写出；压缩器回收一段日志、检查点线程收集索引时独占这个桶。
+ * index 是 DRAM 中按组线性探测的开放寻址表（见 index_group），
+ * 每项为 (tag << 21) | (indirect << 20) | (记录号 + 1)，0 表示空，
+ * indirect 为 1 表示记录中存的是 value_desc，value 本身在 slab 区域
+ */
 struct bucket {
     char *ptr;
-    uint64_t end_off;
+    record_header *headers;
+    checkpoint_header *checkpoint;
+    checkpoint_entry *checkpoint_entries;
+    index_group *index;
+    uint64_t *head_ptr;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> reserved;     //  tail 加上异步队列中已经确认、还没写出的记录数，写入前按它检查空间
+    std::atomic<uint64_t> live;         //  桶中 key 的数量，tail - head - live 即死记录数
+    std::atomic<uint32_t> writers;      //  写者区间内的线程数
+    std::atomic<uint32_t> waiters;      //  因桶满在 WaitSpace 中等待压缩器的写者数
+    std::atomic<uint32_t> epoch;        //  每回收一段日志加一，读者据此判断读到的位置是否被复用
+    std::atomic<bool> exclusive;        //  压缩器或检查点线程独占这个桶
+    uint64_t checkpoint_head;           //  最近一次检查点或恢复结束时的 head，checkpoint_* 只由检查点线程和恢复访问
+    uint64_t checkpoint_tail;           //  同上的 tail，之前的记录都已落盘
+    bool checkpoint_valid;              //  PMem 上有与这两个值一致的检查点
+};
+
+
+/**
+ * 文件头，放在元数据区之后的 4K。打开已有文件时校验 magic 和布局参数，不一致返回 IOError，
+ * 避免把另一种布局或另一种编译配置（LOCAL）创建的文件当作桶日志恢复
+ */
+struct bucket_superblock {
+    uint64_t magic;
+    uint32_t bucket_num;
+    uint32_t pair_size;
+    uint64_t record_num;    //  每个桶的记录数
+};
+
+
+/**
+ * 变长 value 记录的 value 字段内容
+ */
+struct value_desc {
+    uint64_t off;   //  chunk 在 slab 区域中的偏移
+    uint32_t size;  //  value 长度
+    uint32_t crc;   //  chunk 中 value 的 CRC32C
+};
+
+
+/**
+ * SubmitGet 每个线程槽的查找队列。协程版本是在途查找的窗口，提交时新查找先发出索引组的预取，
+ * 窗口满了再推进旧的查找；否则先算 hash 并预取索引组，攒满 DEPTH 个再按 MultiGet 的后两步完成。
+ * 同时存活的线程超过 MAX_THREAD_NUM 时多个线程共用一个队列，所以要加锁，不共用时这把锁没有竞争
+ */
+struct get_queue {
+    const static size_t DEPTH = 16;     //  与 MultiGet 的交错宽度相同
+
+    std::atomic<bool> lock;
+#ifdef USE_COROUTINE
+    lookup_window<DEPTH> window;
+#else
+    uint32_t count;
+    uint64_t hashes[DEPTH];
+    Slice keys[DEPTH];
+    Slice *values[DEPTH];
+    Status *statuses[DEPTH];
+#endif
 };
 
 
-class NvmEngine : DB {
+/**
+ * 桶间 key 数量的分布，用于比较不同哈希函数的倾斜程度
+ */
+struct bucket_skew {
+    uint64_t live_max;
+    double live_avg;
+    double max_ratio;       //  live_max / live_avg
+    double stddev_ratio;    //  标准差 / live_avg
+};
+
+
+class NvmEngine : PmemEngine {
 public:
     /**
      * @param 
      * name: file in AEP(exist)
      * dbptr: pointer of db object
+     * node: 作为 NumaEngine 的分片时所在的 NUMA 节点，索引内存优先从这个节点分配，
+     *       日志文件由 NumaEngine 关闭；-1 表示独立使用
      */
-    NvmEngine(const std::string &name, FILE *log_file = nullptr);
+    NvmEngine(const std::string &name, FILE *log_file = nullptr, const Options &options = Options(), int node = -1);
 
     static Status CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file = nullptr);
 
+    static Status CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file, const Options &options);
+
+    /**
+     * 已有文件不是桶布局或布局参数不同时返回 IOError，文件不存在返回 Ok
+     */
+    static Status CheckLayout(const std::string &name, FILE *log_file);
+
     Status Get(const Slice &key, std::string *value) override;
 
+    Status Get(const Slice &key, Slice *value) override;
+
     Status Set(const Slice &key, const Slice &value) override;
 
+    void MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) override;
+
+    void MultiSet(size_t n, const Slice *keys, const Slice *values, Status *statuses) override;
+
+    void SubmitGet(const Slice &key, Slice *value, Status *status) override;
+
+    void CompleteGets() override;
+
+    /**
+     * key 是否已经写入索引，不拷贝 value，也不计入统计。异步写模式下还在队列中的 key 不算
+     */
+    bool Contains(const Slice &key);
+
+    bool GetProperty(const std::string &property, std::string *value) override;
+
     ~NvmEngine() override;
 
 private:
-    inline void BuildMapping(const std::string &name, size_t size);
-
     inline void InitBucket();
 
-    inline uint16_t Hash(const std::string &key);
+    void BindIndex(size_t size);
 
-private:
-    char *pmem_base_;
-    size_t mapped_size_;
+    void Prefault(char *addr, size_t size, uint32_t thread_num);
+
+    unsigned int ForEachBucket(const std::function<void(bucket &)> &func);
+
+    void Recover();
+
+    uint64_t RecoverBucket(bucket &b, bool *restored, uint64_t *replayed);
+
+    bool LoadCheckpoint(bucket &b);
+
+    uint64_t ReplayLog(bucket &b, uint64_t from, uint64_t *replayed);
+
+    bool CheckChunks(bucket &b);
+
+    void CheckpointLoop(uint32_t period_sec);
+
+    void CheckpointBucket(bucket &b, std::vector<checkpoint_entry> &buffer);
 
-#ifdef USE_LIBPMEM
-    int is_pmem_;
+    void FlushLog(bucket &b, uint64_t begin, uint64_t end);
+
+    inline static uint64_t CheckpointSequence(const checkpoint_header &header, uint64_t no);
+
+    inline static uint32_t CheckpointCrc(const checkpoint_header &header, const checkpoint_entry *entries);
+
+    inline void LockBucket(bucket &b);
+
+    inline void UnlockBucket(bucket &b);
+
+    inline uint32_t *Find(bucket &b, uint64_t hash, const char *key, uint32_t *entry);
+
+    inline Status Read(const Slice &key, uint64_t hash, Slice *value);
+
+#ifdef USE_COROUTINE
+    lookup_task ReadTask(Slice key, Slice *value, Status *status);
+#else
+    inline void PrefetchRecord(uint64_t hash);
+
+    void CompleteQueue(get_queue &queue);
 #endif
 
+    inline void LockQueue(get_queue &queue);
+
+    inline void UnlockQueue(get_queue &queue);
+
+    inline void EnterBucket(bucket &b, bool held);
+
+    inline void LeaveBucket(bucket &b);
+
+    inline bool Admit(bucket &b);
+
+    inline bool Reserve(uint64_t hash, uint64_t *seq);
+
+    bool WaitSpace(bucket &b);
+
+    inline void WriteRecord(uint64_t hash, uint64_t seq, const Slice &key, const char *value, uint8_t type);
+
+    inline static record_header MakeHeader(const char *pair, uint64_t seq, uint8_t type);
+
+    inline bool CheckRecord(bucket &b, uint64_t no, uint64_t seq);
+
+    inline bool CheckChunk(const char *pair);
+
+    inline void Commit(uint64_t hash, uint64_t seq, const Slice &key, const Slice &value, bool indirect);
+
+    inline Status SetIndirect(uint64_t hash, const Slice &key, const Slice &value, bool held = false);
+
+    inline Status Append(uint64_t hash, const Slice &key, const Slice &value);
+
+    void WriteBatch(size_t batch, const Slice *keys, const Slice *values, Status *statuses, bool admitted = false);
+
+    inline bool UpdateInPlace(uint64_t hash, const Slice &key, const Slice &value);
+
+    inline std::atomic<uint32_t> &Version(bucket &b, uint64_t no);
+
+    inline WriteRing &Ring(uint64_t hash);
+
+    inline void Enqueue(WriteRing &ring, uint64_t hash, const char *key, const char *value);
+
+    inline void WaitRing(WriteRing &ring);
+
+    void FlushLoop(uint32_t id);
+
+    uint64_t DrainRing(WriteRing &ring);
+
+    inline uint32_t Publish(bucket &b, uint64_t hash, const char *key, uint64_t seq, bool indirect);
+
+    inline static uint64_t Sequence(bucket &b, uint64_t no);
+
+    void CompactLoop();
+
+    bool CompactSegment(bucket &b, uint64_t *bytes);
+
+    void DumpLoop(uint32_t period_sec);
+
+    std::string StatsString() override;
+
+    double Skew() const override;
+
+    uint64_t LiveKeys() const override;
+
+    bucket_skew BucketSkew() const;
+
+    inline static uint32_t MakeEntry(uint32_t tag, bool indirect, uint64_t no);
+
+    inline static uint32_t EntryTag(uint32_t entry);
+
+    inline static bool EntryIndirect(uint32_t entry);
+
+    inline static uint64_t EntryNo(uint32_t entry);
+
+    inline static const value_desc *Descriptor(bucket &b, uint32_t entry);
+
+    inline static uint64_t Hash(const char *key);
+
+    inline static uint16_t BucketIndex(uint64_t hash);
+
+    inline static uint64_t GroupIndex(uint64_t hash);
+
+    inline static uint8_t TagByte(uint64_t hash);
+
+    inline static uint32_t Tag(uint64_t hash);
+
+    inline void CopyNoDrain(char *dst, const char *src, size_t len, bool flush = true);
+
+    inline void FlushWrite(const void *addr, size_t len);
+
+    void PersistAll();
+
+private:
+    int node_;
+    bool huge_pages_;
+
 #ifndef LOCAL
-    const static size_t MAP_SIZE = 72ull << 30ull;  //  72G（77309411328）
-    const static uint64_t DISPLAY_NUM = 100000000;  //  1亿
+    const static size_t MAP_SIZE = 72ull << 30ull;  //  记录区 72G（77309411328）
 #else
     const static size_t MAP_SIZE = 960ull << 20ull;  //  960M
-    const static uint64_t DISPLAY_NUM = 100000;
 #endif
 
     const static uint64_t KEY_SIZE = 16;
@@ -63,16 +336,54 @@ private:
     const static uint64_t PAIR_NUM = MAP_SIZE / PAIR_SIZE;  //  键值对数量（805306368，不是素数，805306457是素数）
     const static uint16_t BUCKET_NUM = 1ull << 10ull;    //  1024 个桶
     const static uint64_t BUCKET_SIZE = MAP_SIZE / BUCKET_NUM; //  72M（75497472）
-    const static uint16_t FAST_MAP_SIZE = 4ull << 10ull;    //  fast_map_ 的最大 size （4096）
+    const static uint64_t RECORD_NUM = BUCKET_SIZE / PAIR_SIZE;   //  每个桶的记录数量（786432）
+    const static uint64_t CHECKPOINT_OFFSET = (RECORD_NUM * sizeof(record_header) + 63) / 64 * 64;  //  检查点在桶元数据中的偏移，按 cache line 对齐
+    const static uint64_t META_BUCKET_SIZE = (CHECKPOINT_OFFSET + sizeof(checkpoint_header) +
+                                             (RECORD_NUM + 3) / 4 * 4 * sizeof(checkpoint_entry) + sizeof(uint64_t) +
+                                             XPLINE_SIZE - 1) / XPLINE_SIZE * XPLINE_SIZE;  //  每个桶的记录头、检查点和 head，按 XPLine 对齐（12583168）
+    const static uint64_t META_SIZE = BUCKET_NUM * META_BUCKET_SIZE;    //  元数据区 12G，放在记录区之外，72G 全部留给记录
+    const static uint64_t SUPER_OFFSET = MAP_SIZE + META_SIZE;  //  文件头在元数据区之后
+    const static uint64_t SUPER_SIZE = 4096;
+    const static uint64_t FILE_SIZE = SUPER_OFFSET + SUPER_SIZE;    //  slab 区域之前的文件大小（84G）
+    const static uint64_t MAGIC = 0x314c54454b435542ull;   //  "BUCKETL1"
+    const static uint32_t NO_BITS = 20;     //  索引项中记录号所占位数
+    const static uint32_t NO_MASK = (1u << NO_BITS) - 1;
+    const static uint32_t TAG_BITS = 32 - NO_BITS - 1;  //  还有 1 位是 indirect 标志
+    const static uint8_t VALID_INLINE = 1;      //  记录头类型：value 在记录中
+    const static uint8_t VALID_INDIRECT = 2;    //  记录头类型：value 在 slab 中
+    const static uint64_t MAX_VALUE_SIZE = SlabAllocator::MAX_SIZE;
+    const static uint64_t INDEX_GROUP_NUM = RECORD_NUM * 4 / 3 / GROUP_SLOT_NUM + 1;  //  每个桶的索引组数量，装载率不超过 0.75（87382）
+    const static uint64_t INDEX_SIZE = BUCKET_NUM * INDEX_GROUP_NUM * sizeof(index_group);  //  DRAM 索引总大小，每条记录约 7.1 字节（5.33G）
+    const static uint64_t INDEX_BUDGET = 8ull << 30ull;     //  DRAM 索引的上限 8G
+    const static uint64_t SEGMENT_RECORD_NUM = RECORD_NUM / 64;   //  压缩器每次回收的记录数
+    const static uint64_t COMPACT_TRIGGER = RECORD_NUM / 2;       //  日志占用超过一半才压缩
+    const static uint64_t SPACE_WAIT_MS = 1000;                   //  桶满的写者等待 head 前进的最长时间
+    const static size_t MULTI_BATCH = 16;   //  MultiGet / MultiSet 每批交错处理的 key 数
+    const static uint64_t VERSION_NUM = 1ull << 22ull;  //  原地更新的版本号个数（16M 内存），记录按编号轮流共用
 
-    std::hash<std::string> str_hash_;
     std::mutex log_mut_;
-    std::mutex mut_[BUCKET_NUM];
-    std::unordered_map<std::string, std::string> fast_map_[BUCKET_NUM];
     bucket buckets_[BUCKET_NUM];
-    uint64_t get_count_;
-    uint64_t set_count_;
-    FILE *log_file_;
+    ReadCache *cache_;
+    SlabAllocator *slab_;
+    uint64_t compaction_rate_;
+    std::thread compactor_;
+    std::thread dumper_;
+    std::thread checkpointer_;
+    std::vector<std::thread> flushers_;
+    std::vector<WriteRing *> rings_;        //  异步写模式下每个刷写线程一个队列，否则为空
+    get_queue get_queues_[MAX_THREAD_NUM];  //  SubmitGet 每个线程槽的查找队列
+    uint32_t checkpoint_period_sec_;
+    uint32_t flusher_num_;
+    bool in_place_;
+    std::atomic<uint32_t> *versions_;       //  原地更新模式下记录的版本号，否则为空
+    std::atomic<bool> stop_;
+    std::atomic<uint64_t> compacted_segments_;
+    std::atomic<uint64_t> compacted_bytes_;
+    std::atomic<uint64_t> checkpoints_;
+    std::atomic<uint64_t> checkpoint_bytes_;
+    std::atomic<bool> flush_stop_;
+    std::atomic<uint64_t> async_flushed_;
+    std::atomic<uint64_t> async_waits_;     //  队列满时 Set 等待的次数
 };
 
 #endif
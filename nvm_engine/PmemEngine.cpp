@@ -0,0 +1,242 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/24
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include "PmemEngine.hpp"
+
+
+PmemEngine::PmemEngine(FILE *log_file, const Options &options)
+        : pmem_base_(nullptr), mapped_size_(0), durability_(options.durability),
+          group_records_(std::max(options.group_persist_records, 1u)), group_ns_(options.group_persist_us * 1000ull),
+          index_(nullptr), index_size_(0), log_file_(log_file) {
+    memset(stats_, 0, sizeof(stats_));
+    memset(groups_, 0, sizeof(groups_));
+}
+
+
+void PmemEngine::BuildMapping(const std::string &name, size_t size, bool exist) {
+#ifdef USE_LIBPMEM
+    //  已存在的文件直接按原大小映射，不能带 PMEM_FILE_CREATE（会截断重建）
+    int flags = exist ? 0 : PMEM_FILE_CREATE;
+    size_t len = exist ? 0 : size;
+    if ((pmem_base_ = (char *) pmem_map_file(name.c_str(), len, flags, 0666, &mapped_size_, &is_pmem_)) == NULL) {
+        perror("[PmemEngine::BuildMapping] pmem map file failed");
+        exit(1);
+    } else {
+        PrintLog("[PmemEngine::BuildMapping] pmem map file successed\n");
+    }
+    if (mapped_size_ < size) {
+        PrintLog("[PmemEngine::BuildMapping] mapped size %lu is less than %lu\n", mapped_size_, size);
+        exit(1);
+    }
+#else
+    int fd = open(name.c_str(), O_RDWR | O_CREAT, 00777);
+    if (!exist) {
+        lseek(fd, size - 1, SEEK_END);
+        write(fd, " ", 1);
+    } else {
+        struct stat st;
+        fstat(fd, &st);
+        size = st.st_size;
+    }
+    pmem_base_ = MapAligned(size, MAP_SHARED, fd);
+    if (pmem_base_ == MAP_FAILED) {
+        PrintLog("[PmemEngine::BuildMapping] mmap failed\n");
+        perror("mmap failed");
+        exit(1);
+    } else {
+        mapped_size_ = size;
+        PrintLog("[PmemEngine::BuildMapping] mmap successed\n");
+    }
+#endif
+}
+
+
+/**
+ * 索引全部放在 DRAM，匿名映射按需分配物理页（页对齐，组天然按 cache line 对齐），初始即为 0（空槽）。
+ * 大页只用于索引；PMem 文件不在 DAX 上时走页缓存，大页会让一次小写入标脏并写回整个大页
+ */
+void PmemEngine::MapIndex(uint64_t size, bool huge_pages) {
+    index_ = (index_group *) MapAligned(size, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    if (index_ == MAP_FAILED) {
+        PrintLog("[PmemEngine::MapIndex] mmap index failed\n");
+        perror("mmap index failed");
+        exit(1);
+    }
+    index_size_ = size;
+    if (huge_pages && madvise(index_, size, MADV_HUGEPAGE) != 0) {
+        PrintLog("[PmemEngine::MapIndex] transparent huge pages unavailable for index, keep 4K pages\n");
+    }
+}
+
+
+/**
+ * 先占住多出 2M 的匿名区域，把真正的映射用 MAP_FIXED 放到其中 2M 对齐的位置，再归还多余的头尾。
+ * DAX 文件的映射地址和文件物理布局都按 2M 对齐时，内核自动按 2M 建立页表，不需要 madvise；
+ * pmem_map_file 自己也会选 2M 对齐的地址
+ */
+char *PmemEngine::MapAligned(size_t size, int flags, int fd) {
+    size_t reserved = size + HUGE_PAGE_SIZE;
+    char *base = (char *) mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return base;
+    }
+    char *aligned = (char *) (((uintptr_t) base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    char *addr = (char *) mmap(aligned, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0);
+    if (addr == MAP_FAILED) {
+        munmap(base, reserved);
+        return addr;
+    }
+    if (aligned > base) {
+        munmap(base, aligned - base);
+    }
+    if (base + reserved > aligned + size) {
+        munmap(aligned + size, base + reserved - (aligned + size));
+    }
+    return addr;
+}
+
+
+bool PmemEngine::ReadSuperblock(const std::string &name, uint64_t offset, void *super, size_t len) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    memset(super, 0, len);
+    if (pread(fd, super, len, offset) != (ssize_t) len) {
+        memset(super, 0, len);
+    }
+    close(fd);
+    return true;
+}
+
+
+engine_stat PmemEngine::SumStats() const {
+    engine_stat sum;
+    memset(&sum, 0, sizeof(sum));
+    for (auto &stat : stats_) {
+        sum.gets += __atomic_load_n(&stat.gets, __ATOMIC_RELAXED);
+        sum.get_misses += __atomic_load_n(&stat.get_misses, __ATOMIC_RELAXED);
+        sum.sets += __atomic_load_n(&stat.sets, __ATOMIC_RELAXED);
+        sum.set_failures += __atomic_load_n(&stat.set_failures, __ATOMIC_RELAXED);
+        sum.user_bytes += __atomic_load_n(&stat.user_bytes, __ATOMIC_RELAXED);
+        sum.media_bytes += __atomic_load_n(&stat.media_bytes, __ATOMIC_RELAXED);
+        sum.flushes += __atomic_load_n(&stat.flushes, __ATOMIC_RELAXED);
+        sum.drains += __atomic_load_n(&stat.drains, __ATOMIC_RELAXED);
+    }
+    //  读取各槽不在同一时刻，运行中 misses 可能暂时多于 gets
+    sum.get_misses = std::min(sum.get_misses, sum.gets);
+    sum.set_failures = std::min(sum.set_failures, sum.sets);
+    return sum;
+}
+
+
+/**
+ * 索引实际占用的物理内存。索引是匿名映射，没写过的页不占内存，用 mincore 逐页统计
+ */
+uint64_t PmemEngine::IndexResidentBytes() const {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> vec((index_size_ + page - 1) / page);
+    if (mincore(index_, index_size_, vec.data()) != 0) {
+        return 0;
+    }
+    uint64_t pages = 0;
+    for (unsigned char v : vec) {
+        pages += v & 1;
+    }
+    return pages * page < index_size_ ? pages * page : index_size_;
+}
+
+
+std::string PmemEngine::OpsString(const char *prefix) const {
+    engine_stat sum = SumStats();
+    char buf[512];
+    int len = snprintf(
+            buf, sizeof(buf),
+            "%sops, gets = %lu, hits = %lu, misses = %lu, sets = %lu, set_failures = %lu\n"
+            "%spersist, user_bytes = %lu, media_bytes = %lu, write amplification = %.2lf, flushes = %lu, drains = %lu\n",
+            prefix, sum.gets, sum.gets - sum.get_misses, sum.get_misses, sum.sets, sum.set_failures,
+            prefix, sum.user_bytes, sum.media_bytes,
+            sum.user_bytes ? (double) sum.media_bytes / sum.user_bytes : 0.0, sum.flushes, sum.drains);
+    return std::string(buf, std::min((size_t) len, sizeof(buf) - 1));
+}
+
+
+std::string PmemEngine::IndexString(const char *prefix, uint64_t records) const {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "%sindex, bytes = %lu, resident_bytes = %lu, bytes_per_record = %.2lf\n",
+                       prefix, index_size_, IndexResidentBytes(), (double) index_size_ / records);
+    return std::string(buf, std::min((size_t) len, sizeof(buf) - 1));
+}
+
+
+bool PmemEngine::GetProperty(const std::string &property, std::string *value) {
+    if (property == "nvm.stats") {
+        *value = StatsString();
+        return true;
+    }
+    if (property == "nvm.bucket-skew") {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.4lf", Skew());
+        *value = buf;
+        return true;
+    }
+
+    engine_stat sum = SumStats();
+    uint64_t n;
+    if (property == "nvm.gets") {
+        n = sum.gets;
+    } else if (property == "nvm.get-hits") {
+        n = sum.gets - sum.get_misses;
+    } else if (property == "nvm.get-misses") {
+        n = sum.get_misses;
+    } else if (property == "nvm.sets") {
+        n = sum.sets;
+    } else if (property == "nvm.set-failures") {
+        n = sum.set_failures;
+    } else if (property == "nvm.user-bytes") {
+        n = sum.user_bytes;
+    } else if (property == "nvm.media-bytes") {
+        n = sum.media_bytes;
+    } else if (property == "nvm.flushes") {
+        n = sum.flushes;
+    } else if (property == "nvm.drains") {
+        n = sum.drains;
+    } else if (property == "nvm.index-bytes") {
+        n = index_size_;
+    } else if (property == "nvm.index-resident-bytes") {
+        n = IndexResidentBytes();
+    } else if (property == "nvm.live-keys") {
+        n = LiveKeys();
+    } else {
+        return false;
+    }
+    *value = std::to_string(n);
+    return true;
+}
+
+
+PmemEngine::~PmemEngine() {
+    if (pmem_base_) {
+#ifdef USE_LIBPMEM
+        pmem_unmap(pmem_base_, mapped_size_);
+#else
+        munmap(pmem_base_, mapped_size_);
+#endif
+    }
+    if (index_) {
+        munmap(index_, index_size_);
+    }
+}
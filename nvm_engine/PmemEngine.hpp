@@ -0,0 +1,195 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/24
+ * @project: tair-contest
+ * @desp: 两种 PMem 布局共用的部分：文件映射、持久化、按线程槽的统计和 DRAM 索引的内存统计
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_PMEM_ENGINE_H_
+#define TAIR_CONTEST_KV_CONTEST_PMEM_ENGINE_H_
+
+#include <sys/mman.h>
+#include <chrono>
+#include <string>
+#include "Statement.hpp"
+#include "IndexGroup.hpp"
+
+
+/**
+ * 每个线程槽一份的计数，正好占满一个 cache line，通常只由占用槽的线程写（见 PmemEngine::Add），
+ * 统计线程和 GetProperty 求和时读取
+ */
+struct engine_stat {
+    uint64_t gets;          //  Get 和 MultiGet 中的 key 数
+    uint64_t get_misses;    //  其中返回 NotFound 的
+    uint64_t sets;          //  Set 和 MultiSet 中的 key 数
+    uint64_t set_failures;  //  其中没有返回 Ok 的
+    uint64_t user_bytes;    //  用户写入的字节数
+    uint64_t media_bytes;   //  按 XPLine 计算的介质写入字节数
+    uint64_t flushes;       //  Flush 调用次数
+    uint64_t drains;        //  Drain（sfence）调用次数
+};
+
+static_assert(sizeof(engine_stat) == 64, "engine_stat should fill one cache line");
+
+
+/**
+ * DurabilityGroup 下每个线程还没有 fence 的记录数和上次 fence 的时间，独占一个 cache line
+ */
+struct persist_group {
+    uint64_t pending;
+    uint64_t last_ns;
+    char padding[48];
+};
+
+
+/**
+ * NvmEngine（桶布局）和 ThreadLogEngine（按线程分区的布局）的基类。
+ * 子类负责文件中记录的组织、索引的内容和恢复，这里只管映射、刷出、统计和两者相同的属性；
+ * 映射的文件和索引在析构时释放，子类析构时仍可以访问
+ */
+class PmemEngine : public DB {
+public:
+    /**
+     * nvm.stats、nvm.bucket-skew、nvm.live-keys、各项计数和索引大小，具体内容由子类的 StatsString、Skew 和 LiveKeys 提供
+     */
+    bool GetProperty(const std::string &property, std::string *value) override;
+
+    ~PmemEngine() override;
+
+protected:
+    PmemEngine(FILE *log_file, const Options &options);
+
+    void BuildMapping(const std::string &name, size_t size, bool exist);
+
+    void MapIndex(uint64_t size, bool huge_pages);
+
+    static char *MapAligned(size_t size, int flags, int fd);
+
+    /**
+     * 读出已有文件 offset 处 len 字节的文件头，读不满的部分为 0；文件不存在返回 false
+     */
+    static bool ReadSuperblock(const std::string &name, uint64_t offset, void *super, size_t len);
+
+    inline void Flush(const void *addr, size_t len);
+
+    inline void Drain();
+
+    inline void Persist(const void *addr, size_t len);
+
+    inline void EndWrite(uint64_t n = 1);
+
+    inline engine_stat &Stat();
+
+    inline static void Add(uint64_t &counter, uint64_t n = 1);
+
+    engine_stat SumStats() const;
+
+    uint64_t IndexResidentBytes() const;
+
+    /**
+     * 统计中两种布局相同的部分：ops、persist 两行和 index 一行，records 是索引按其计算每条记录字节数的记录数
+     */
+    std::string OpsString(const char *prefix) const;
+
+    std::string IndexString(const char *prefix, uint64_t records) const;
+
+    virtual std::string StatsString() = 0;
+
+    virtual double Skew() const = 0;
+
+    virtual uint64_t LiveKeys() const = 0;
+
+protected:
+    char *pmem_base_;
+    size_t mapped_size_;
+    Durability durability_;
+    uint64_t group_records_;
+    uint64_t group_ns_;
+
+#ifdef USE_LIBPMEM
+    int is_pmem_;
+#endif
+
+    const static size_t HUGE_PAGE_SIZE = 2ull << 20ull;     //  映射按 2M 对齐，便于使用大页
+
+    index_group *index_;
+    uint64_t index_size_;
+    engine_stat stats_[MAX_THREAD_NUM];
+    persist_group groups_[MAX_THREAD_NUM];
+    FILE *log_file_;
+};
+
+
+/**
+ * 刷出 cache，不等待完成，需要配合 Drain 使用
+ */
+inline void PmemEngine::Flush(const void *addr, size_t len) {
+    Add(Stat().flushes);
+#ifdef USE_LIBPMEM
+    if (is_pmem_)
+        pmem_flush(addr, len);
+    else
+        pmem_msync(addr, len);
+#else
+    msync((void *) ((uintptr_t) addr & ~4095ull), len + ((uintptr_t) addr & 4095ull), MS_SYNC);
+#endif
+}
+
+
+/**
+ * 等待之前的 Flush 和非临时写全部落盘（sfence）
+ */
+inline void PmemEngine::Drain() {
+    Add(Stat().drains);
+#ifdef USE_LIBPMEM
+    if (is_pmem_)
+        pmem_drain();
+#endif
+}
+
+
+inline void PmemEngine::Persist(const void *addr, size_t len) {
+    Flush(addr, len);
+    Drain();
+}
+
+
+/**
+ * 当前线程的 n 条记录都已发出写入，按持久化级别决定是否等待落盘。
+ * DurabilityGroup 下每个线程累计 group_records_ 条或距上次 fence 超过 group_ns_ 才 fence 一次
+ */
+inline void PmemEngine::EndWrite(uint64_t n) {
+    if (durability_ == DurabilityStrict) {
+        Drain();
+        return;
+    }
+    if (durability_ == DurabilityRelaxed) {
+        return;
+    }
+    persist_group &group = groups_[ThreadId()];
+    group.pending += n;
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (group.pending >= group_records_ || now - group.last_ns >= group_ns_) {
+        Drain();
+        group.pending = 0;
+        group.last_ns = now;
+    }
+}
+
+
+inline engine_stat &PmemEngine::Stat() {
+    return stats_[ThreadId()];
+}
+
+
+/**
+ * 存活线程超过 MAX_THREAD_NUM 时多出的线程和占用槽的线程共用计数，所以用原子加。
+ * 槽通常只有一个线程在写，cache line 不会来回迁移
+ */
+inline void PmemEngine::Add(uint64_t &counter, uint64_t n) {
+    __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+}
+
+#endif
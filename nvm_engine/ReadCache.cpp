@@ -0,0 +1,210 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/16
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <cstring>
+#include <immintrin.h>
+#include "ReadCache.hpp"
+
+
+ReadCache::ReadCache(uint64_t size) {
+    static_assert(sizeof(cache_entry) == 128, "cache_entry should be two cache lines");
+
+    set_num_ = size / (sizeof(cache_entry) * WAYS);
+    if (set_num_ == 0) {
+        set_num_ = 1;
+    }
+    sets_ = new cache_set[set_num_]();
+    entries_ = new cache_entry[set_num_ * WAYS]();
+    for (auto &stat : stats_) {
+        stat.hits.store(0, std::memory_order_relaxed);
+        stat.misses.store(0, std::memory_order_relaxed);
+    }
+}
+
+
+ReadCache::~ReadCache() {
+    delete[] sets_;
+    delete[] entries_;
+}
+
+
+/**
+ * 低 30 位已经用于选桶和索引槽，这里用更高的位
+ */
+inline uint64_t ReadCache::SetIndex(uint64_t hash) const {
+    return (hash >> 30) % set_num_;
+}
+
+
+inline void ReadCache::Lock(cache_set &set) {
+    while (set.lock.exchange(1, std::memory_order_acquire)) {
+        _mm_pause();
+    }
+}
+
+
+inline void ReadCache::Unlock(cache_set &set) {
+    set.lock.store(0, std::memory_order_release);
+}
+
+
+inline void ReadCache::Write(cache_entry &entry, const char *key, const char *value, uint64_t no) {
+    entry.seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(entry.key, key, KEY_SIZE);
+    memcpy(entry.value, value, VALUE_SIZE);
+    entry.no = no;
+    entry.used = 1;
+    entry.seq.fetch_add(1, std::memory_order_release);
+}
+
+
+bool ReadCache::Get(uint64_t hash, const char *key, char *buf) {
+    cache_entry *entries = entries_ + SetIndex(hash) * WAYS;
+
+    for (uint32_t i = 0; i < WAYS; ++i) {
+        cache_entry &entry = entries[i];
+        bool match;
+        while (true) {
+            uint32_t seq = entry.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                _mm_pause();
+                continue;
+            }
+            match = entry.used && memcmp(entry.key, key, KEY_SIZE) == 0;
+            if (match) {
+                memcpy(buf, entry.value, VALUE_SIZE);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (entry.seq.load(std::memory_order_relaxed) == seq) {
+                break;
+            }
+        }
+        if (match) {
+            if (!entry.ref.load(std::memory_order_relaxed)) {
+                entry.ref.store(1, std::memory_order_relaxed);
+            }
+            stats_[ThreadId()].hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    stats_[ThreadId()].misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+
+uint32_t ReadCache::Generation(uint64_t hash) {
+    return sets_[SetIndex(hash)].generation.load(std::memory_order_acquire);
+}
+
+
+void ReadCache::Insert(uint64_t hash, const char *key, const char *value, uint64_t no, uint32_t generation) {
+    uint64_t index = SetIndex(hash);
+    cache_set &set = sets_[index];
+    cache_entry *entries = entries_ + index * WAYS;
+
+    Lock(set);
+    if (set.generation.load(std::memory_order_relaxed) != generation) {
+        Unlock(set);
+        return;
+    }
+
+    cache_entry *victim = nullptr;
+    for (uint32_t i = 0; i < WAYS; ++i) {
+        cache_entry &entry = entries[i];
+        if (entry.used && memcmp(entry.key, key, KEY_SIZE) == 0) {
+            //  其他线程已经回填过
+            if (entry.no < no) {
+                Write(entry, key, value, no);
+            }
+            Unlock(set);
+            return;
+        }
+        if (!entry.used && victim == nullptr) {
+            victim = &entry;
+        }
+    }
+
+    //  组已满，CLOCK：跳过并清掉访问位为 1 的项，淘汰第一个访问位为 0 的项
+    while (victim == nullptr) {
+        cache_entry &entry = entries[set.hand];
+        set.hand = (set.hand + 1) % WAYS;
+        if (entry.ref.load(std::memory_order_relaxed)) {
+            entry.ref.store(0, std::memory_order_relaxed);
+        } else {
+            victim = &entry;
+        }
+    }
+    victim->ref.store(0, std::memory_order_relaxed);
+    Write(*victim, key, value, no);
+    Unlock(set);
+}
+
+
+void ReadCache::Update(uint64_t hash, const char *key, const char *value, uint64_t no) {
+    uint64_t index = SetIndex(hash);
+    cache_set &set = sets_[index];
+    cache_entry *entries = entries_ + index * WAYS;
+
+    Lock(set);
+    set.generation.fetch_add(1, std::memory_order_release);
+    for (uint32_t i = 0; i < WAYS; ++i) {
+        cache_entry &entry = entries[i];
+        if (entry.used && memcmp(entry.key, key, KEY_SIZE) == 0) {
+            if (entry.no <= no) {
+                Write(entry, key, value, no);
+            }
+            break;
+        }
+    }
+    Unlock(set);
+}
+
+
+void ReadCache::Invalidate(uint64_t hash, const char *key) {
+    uint64_t index = SetIndex(hash);
+    cache_set &set = sets_[index];
+    cache_entry *entries = entries_ + index * WAYS;
+
+    Lock(set);
+    set.generation.fetch_add(1, std::memory_order_release);
+    for (uint32_t i = 0; i < WAYS; ++i) {
+        cache_entry &entry = entries[i];
+        if (entry.used && memcmp(entry.key, key, KEY_SIZE) == 0) {
+            entry.seq.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            entry.used = 0;
+            entry.seq.fetch_add(1, std::memory_order_release);
+            break;
+        }
+    }
+    Unlock(set);
+}
+
+
+uint64_t ReadCache::Capacity() const {
+    return set_num_ * WAYS;
+}
+
+
+uint64_t ReadCache::Hits() const {
+    uint64_t hits = 0;
+    for (auto &stat : stats_) {
+        hits += stat.hits.load(std::memory_order_relaxed);
+    }
+    return hits;
+}
+
+
+uint64_t ReadCache::Misses() const {
+    uint64_t misses = 0;
+    for (auto &stat : stats_) {
+        misses += stat.misses.load(std::memory_order_relaxed);
+    }
+    return misses;
+}
@@ -0,0 +1,109 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/16
+ * @project: tair-contest
+ * @desp: DRAM 热点 value 缓存，组相联 + 组内 CLOCK 淘汰
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_READ_CACHE_H_
+#define TAIR_CONTEST_KV_CONTEST_READ_CACHE_H_
+
+#include <atomic>
+#include "Statement.hpp"
+
+
+/**
+ * 缓存项，占两个 cache line。写者持有组锁，seq 为奇数表示正在写，读者发现 seq 变化就重试
+ */
+struct cache_entry {
+    std::atomic<uint32_t> seq;
+    uint64_t no;                //  缓存的是桶内哪个序列号的记录的值，只允许换成更新的版本
+    std::atomic<uint8_t> ref;   //  CLOCK 访问位
+    uint8_t used;
+    char key[16];
+    char value[80];
+    char padding[14];
+};
+
+
+/**
+ * 组头。generation 在每次 Set 经过这个组时加一，
+ * Get 未命中后回填时若 generation 已变化则放弃回填，避免把读到的旧值放进缓存
+ */
+struct cache_set {
+    std::atomic<uint8_t> lock;
+    uint8_t hand;               //  CLOCK 指针
+    std::atomic<uint32_t> generation;
+};
+
+
+/**
+ * 每个线程一份的命中计数，独占一个 cache line。同时存活的线程超过 MAX_THREAD_NUM 时会共用，
+ * 而且 Hits / Misses 随时会读，所以用原子的 fetch_add
+ */
+struct cache_stat {
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    char padding[48];
+};
+
+
+class ReadCache {
+public:
+    /**
+     * @param
+     * size: 缓存占用的 DRAM 字节数
+     */
+    explicit ReadCache(uint64_t size);
+
+    ~ReadCache();
+
+    /**
+     * 命中时把 value 拷贝到 buf（VALUE_SIZE 字节）
+     */
+    bool Get(uint64_t hash, const char *key, char *buf);
+
+    uint32_t Generation(uint64_t hash);
+
+    /**
+     * Get 未命中、从 PMem 读到值之后回填
+     */
+    void Insert(uint64_t hash, const char *key, const char *value, uint64_t no, uint32_t generation);
+
+    /**
+     * Set 之后调用，只更新已缓存的 key，不把新写入的 key 放进缓存
+     */
+    void Update(uint64_t hash, const char *key, const char *value, uint64_t no);
+
+    /**
+     * 变长 value 不进缓存，Set 之后把这个 key 已缓存的旧值作废
+     */
+    void Invalidate(uint64_t hash, const char *key);
+
+    uint64_t Capacity() const;
+
+    uint64_t Hits() const;
+
+    uint64_t Misses() const;
+
+private:
+    inline uint64_t SetIndex(uint64_t hash) const;
+
+    inline void Lock(cache_set &set);
+
+    inline void Unlock(cache_set &set);
+
+    inline static void Write(cache_entry &entry, const char *key, const char *value, uint64_t no);
+
+private:
+    const static uint64_t KEY_SIZE = 16;
+    const static uint64_t VALUE_SIZE = 80;
+    const static uint32_t WAYS = 8;     //  每组 8 路
+
+    uint64_t set_num_;
+    cache_set *sets_;
+    cache_entry *entries_;
+    cache_stat stats_[MAX_THREAD_NUM];
+};
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/18
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <sys/mman.h>
+#include <immintrin.h>
+#include "SlabAllocator.hpp"
+
+
+SlabAllocator::SlabAllocator(char *base, uint64_t size, bool is_pmem, bool exist)
+        : base_(base), page_num_(size / SLAB_PAGE_SIZE), is_pmem_(is_pmem), page_class_((uint8_t *) base),
+          next_page_(1), live_(nullptr) {
+    static_assert(MAX_SIZE == 128ull << (CLASS_NUM - 1), "MAX_SIZE should be the largest chunk size");
+
+    for (auto &t : threads_) {
+        t.lock.store(0, std::memory_order_relaxed);
+        for (uint32_t cls = 0; cls < CLASS_NUM; ++cls) {
+            t.cur[cls] = t.end[cls] = 0;
+        }
+    }
+
+    if (exist) {
+        //  页按顺序分配，最后一个已分配页之后的都是空闲页
+        for (uint64_t page = 1; page < page_num_; ++page) {
+            if (page_class_[page] != 0) {
+                next_page_.store(page + 1, std::memory_order_relaxed);
+            }
+        }
+        live_ = new std::atomic<uint64_t>[page_num_ * SLAB_PAGE_SIZE / ChunkSize(0) / 64]();
+    }
+}
+
+
+SlabAllocator::~SlabAllocator() {
+    delete[] live_;
+}
+
+
+inline void SlabAllocator::Lock(slab_thread &t) {
+    while (t.lock.exchange(1, std::memory_order_acquire)) {
+        _mm_pause();
+    }
+}
+
+
+inline bool SlabAllocator::TryLock(slab_thread &t) {
+    return t.lock.exchange(1, std::memory_order_acquire) == 0;
+}
+
+
+inline void SlabAllocator::Unlock(slab_thread &t) {
+    t.lock.store(0, std::memory_order_release);
+}
+
+
+inline void SlabAllocator::PersistPageClass(uint64_t page) {
+#ifdef USE_LIBPMEM
+    if (is_pmem_) {
+        pmem_persist(page_class_ + page, 1);
+    } else {
+        pmem_msync(page_class_ + page, 1);
+    }
+#else
+    msync((void *) ((uintptr_t) (page_class_ + page) & ~4095ull), 4096, MS_SYNC);
+#endif
+}
+
+
+uint64_t SlabAllocator::Allocate(uint32_t cls) {
+    slab_thread &t = threads_[ThreadId()];
+    uint64_t off = 0;
+
+    Lock(t);
+    if (!t.free[cls].empty()) {
+        off = t.free[cls].back();
+        t.free[cls].pop_back();
+    } else {
+        if (t.cur[cls] == t.end[cls]) {
+            uint64_t page = next_page_.fetch_add(1, std::memory_order_relaxed);
+            if (page >= page_num_) {
+                Unlock(t);
+                return Steal(cls);
+            }
+            page_class_[page] = cls + 1;
+            PersistPageClass(page);
+            t.cur[cls] = page * SLAB_PAGE_SIZE;
+            t.end[cls] = t.cur[cls] + SLAB_PAGE_SIZE;
+        }
+        off = t.cur[cls];
+        t.cur[cls] += ChunkSize(cls);
+    }
+    Unlock(t);
+
+    return off;
+}
+
+
+/**
+ * 没有新页可分时，从其他线程的空闲链表中取一个 chunk，同时搬走一半放到当前线程。
+ * 空闲链表只能在持有其所属线程的锁时访问；拿不到锁的线程正在分配或释放，直接跳过
+ */
+uint64_t SlabAllocator::Steal(uint32_t cls) {
+    uint32_t self = ThreadId();
+    slab_thread &t = threads_[self];
+
+    for (uint32_t i = 1; i < MAX_THREAD_NUM; ++i) {
+        slab_thread &victim = threads_[(self + i) % MAX_THREAD_NUM];
+        if (!TryLock(victim)) {
+            continue;
+        }
+        std::vector<uint64_t> stolen;
+        size_t keep = victim.free[cls].size() / 2;
+        stolen.assign(victim.free[cls].begin() + keep, victim.free[cls].end());
+        victim.free[cls].resize(keep);
+        Unlock(victim);
+        if (stolen.empty()) {
+            continue;
+        }
+
+        uint64_t off = stolen.back();
+        stolen.pop_back();
+        Lock(t);
+        t.free[cls].insert(t.free[cls].end(), stolen.begin(), stolen.end());
+        Unlock(t);
+        return off;
+    }
+    return 0;
+}
+
+
+/**
+ * 放回当前线程的空闲链表，之后由这个线程复用
+ */
+void SlabAllocator::Free(uint64_t off, uint32_t cls) {
+    slab_thread &t = threads_[ThreadId()];
+    Lock(t);
+    t.free[cls].push_back(off);
+    Unlock(t);
+}
+
+
+void SlabAllocator::MarkLive(uint64_t off) {
+    uint64_t bit = off / ChunkSize(0);
+    live_[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+}
+
+
+void SlabAllocator::Rebuild() {
+    uint64_t next_page = next_page_.load(std::memory_order_relaxed);
+    for (uint64_t page = 1; page < next_page && page < page_num_; ++page) {
+        if (page_class_[page] == 0) {
+            continue;
+        }
+        uint32_t cls = page_class_[page] - 1;
+        slab_thread &t = threads_[page % MAX_THREAD_NUM];
+        for (uint64_t off = page * SLAB_PAGE_SIZE; off < (page + 1) * SLAB_PAGE_SIZE; off += ChunkSize(cls)) {
+            uint64_t bit = off / ChunkSize(0);
+            if ((live_[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64))) == 0) {
+                t.free[cls].push_back(off);
+            }
+        }
+    }
+
+    delete[] live_;
+    live_ = nullptr;
+}
+
+
+uint64_t SlabAllocator::UsedPages() const {
+    uint64_t next_page = next_page_.load(std::memory_order_relaxed);
+    return next_page < page_num_ ? next_page - 1 : page_num_ - 1;
+}
+
+
+void SlabAllocator::Persist() {
+    char *start = base_ + SLAB_PAGE_SIZE;
+    size_t len = UsedPages() * SLAB_PAGE_SIZE;
+#ifdef USE_LIBPMEM
+    if (is_pmem_) {
+        pmem_persist(start, len);
+    } else {
+        pmem_msync(start, len);
+    }
+#else
+    msync(start, len, MS_SYNC);
+#endif
+}
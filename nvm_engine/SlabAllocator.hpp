@@ -0,0 +1,116 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/18
+ * @project: tair-contest
+ * @desp: 变长 value 的 PMem slab 分配器
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_SLAB_ALLOCATOR_H_
+#define TAIR_CONTEST_KV_CONTEST_SLAB_ALLOCATOR_H_
+
+#include <atomic>
+#include <vector>
+#include "Statement.hpp"
+
+
+/**
+ * 每个线程一份的分配状态，独占 cache line。
+ * 同时存活的线程超过 MAX_THREAD_NUM 时多个线程共用一份，所以仍需要 lock
+ */
+struct slab_thread {
+    std::atomic<uint8_t> lock;
+    uint64_t cur[4];                    //  各 size class 当前页中下一个 chunk 的偏移
+    uint64_t end[4];                    //  各 size class 当前页的结束偏移
+    std::vector<uint64_t> free[4];      //  各 size class 的空闲 chunk
+};
+
+
+/**
+ * slab 区域布局：第一页是页表，每页 1 字节记录该页的 size class（0 表示未分配），
+ * 之后每页按需分给一个 size class，切成等长的 chunk。
+ * 页表在分配新页时持久化；chunk 的分配状态不落盘，重启时由索引中存活的记录推导。
+ * 页一旦分给某个 size class 就不再改变，value 长度分布变化很大时可能出现某个 class 分配失败
+ */
+class SlabAllocator {
+public:
+    const static uint32_t CLASS_NUM = 4;
+    const static uint64_t MAX_SIZE = 1024;      //  支持的最大 value 长度
+
+    /**
+     * @param
+     * base: slab 区域起始地址
+     * size: slab 区域大小
+     * is_pmem: 是否真正的 PMem，决定持久化方式
+     * exist: 文件是否已存在，已存在时先调用 MarkLive 再调用 Rebuild
+     */
+    SlabAllocator(char *base, uint64_t size, bool is_pmem, bool exist);
+
+    ~SlabAllocator();
+
+    /**
+     * value 长度对应的 size class，超过 MAX_SIZE 返回 CLASS_NUM
+     */
+    inline static uint32_t SizeClass(uint64_t size) {
+        uint32_t cls = 0;
+        while (cls < CLASS_NUM && ChunkSize(cls) < size) {
+            ++cls;
+        }
+        return cls;
+    }
+
+    inline static uint64_t ChunkSize(uint32_t cls) {
+        return 128ull << cls;
+    }
+
+    inline char *Chunk(uint64_t off) const {
+        return base_ + off;
+    }
+
+    /**
+     * 返回 chunk 偏移，空间不足返回 0
+     */
+    uint64_t Allocate(uint32_t cls);
+
+    void Free(uint64_t off, uint32_t cls);
+
+    /**
+     * 恢复时标记仍被引用的 chunk，可并发调用
+     */
+    void MarkLive(uint64_t off);
+
+    /**
+     * 恢复时把已分配页中未被引用的 chunk 放回空闲链表
+     */
+    void Rebuild();
+
+    uint64_t UsedPages() const;
+
+    /**
+     * 持久化所有已分配页，用于写入 chunk 时没有刷出的情况
+     */
+    void Persist();
+
+private:
+    inline void Lock(slab_thread &t);
+
+    inline bool TryLock(slab_thread &t);
+
+    inline void Unlock(slab_thread &t);
+
+    inline void PersistPageClass(uint64_t page);
+
+    uint64_t Steal(uint32_t cls);
+
+private:
+    const static uint64_t SLAB_PAGE_SIZE = 1ull << 20ull;   //  1M
+
+    char *base_;
+    uint64_t page_num_;
+    bool is_pmem_;
+    uint8_t *page_class_;
+    std::atomic<uint64_t> next_page_;
+    std::atomic<uint64_t> *live_;   //  恢复期间的存活 bitmap，以最小 chunk 为粒度
+    slab_thread threads_[MAX_THREAD_NUM];
+};
+
+#endif
@@ -10,6 +10,12 @@
 
 //#define CLION   //  Windows Clion CMake 本地调试
 //#define LOCAL   //  Centos 本地调试
+//#define STRING_HASH   //  使用原来的 std::hash<std::string>，用于对比桶间分布
+//#define USE_COROUTINE //  MultiGet 用 C++20 无栈协程交错查找，需要 -std=c++20（make COROUTINE=1）
+
+#if defined(USE_COROUTINE) && !defined(__cpp_impl_coroutine)
+#error "USE_COROUTINE needs a C++20 compiler with coroutine support (-std=c++20)"
+#endif
 
 #ifndef USE_LIBPMEM
 #define USE_LIBPMEM
@@ -36,4 +42,61 @@
 #include "db.hpp"
 #endif
 
+#include <atomic>
+#include <cstdint>
+
+const static uint64_t CONTEST_KEY_NUM = 16ull * 48000000ull;  //  比赛 Set 阶段写入的键值对数量：16 个线程各 4800 万
+const static uint32_t MAX_THREAD_NUM = 64;  //  按线程的槽数，线程退出后槽位回收，同时存活的线程超过这个数时多出的线程共用槽
+
+static_assert(MAX_THREAD_NUM == 64, "thread slots are tracked in one 64-bit mask");
+
+/**
+ * 线程第一次调用 ThreadId 时占用编号最小的空闲槽，退出时释放给之后的线程。
+ * 没有空闲槽时按到达顺序和其他线程共用槽，shared 为 true，所以按槽的状态仍然要加锁或者用原子操作。
+ * 释放槽位的原子操作同时排空本线程还没有完成的刷写，接手槽位的线程不会漏掉组提交中的记录
+ */
+struct thread_slot {
+    uint32_t id;
+    bool shared;
+
+    thread_slot() : id(0), shared(true) {
+        uint64_t used = Used().load(std::memory_order_relaxed);
+        while (~used != 0) {
+            uint32_t free = __builtin_ctzll(~used);
+            if (Used().compare_exchange_weak(used, used | (1ull << free), std::memory_order_acq_rel)) {
+                id = free;
+                shared = false;
+                return;
+            }
+        }
+        static std::atomic<uint32_t> next_id(0);
+        id = next_id.fetch_add(1, std::memory_order_relaxed) % MAX_THREAD_NUM;
+    }
+
+    ~thread_slot() {
+        if (!shared) {
+            Used().fetch_and(~(1ull << id), std::memory_order_acq_rel);
+        }
+    }
+
+    static std::atomic<uint64_t> &Used() {
+        static std::atomic<uint64_t> used(0);
+        return used;
+    }
+};
+
+
+inline const thread_slot &ThreadSlot() {
+    static thread_local thread_slot slot;
+    return slot;
+}
+
+
+/**
+ * 当前线程的槽号，取值 [0, MAX_THREAD_NUM)
+ */
+inline uint32_t ThreadId() {
+    return ThreadSlot().id;
+}
+
 #endif
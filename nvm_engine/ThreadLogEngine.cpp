@@ -0,0 +1,422 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/17
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstddef>
+#include "ThreadLogEngine.hpp"
+
+#ifndef CLION
+#include "include/crc32c.hpp"
+#else
+#include "crc32c.hpp"
+#endif
+
+#define LIKELY(x) (__builtin_expect((x), 1))
+#define UNLIKELY(x) (__builtin_expect((x), 0))
+
+
+ThreadLogEngine::ThreadLogEngine(const std::string &name, FILE *log_file, const Options &options)
+        : PmemEngine(log_file, options) {
+    static_assert(sizeof(log_record) == 128, "log_record should be half an XPLine");
+    static_assert(sizeof(log_superblock) <= SUPER_SIZE, "superblock overflows its page");
+    static_assert(sizeof(log_region) == 64, "log_region should be one cache line");
+    static_assert(MAX_RECORDS < (1ull << 32) - 1, "record number overflows index entry");
+    static_assert(INDEX_SIZE <= INDEX_BUDGET, "index exceeds the DRAM budget");
+#ifndef LOCAL
+    static_assert(MAX_RECORDS >= CONTEST_KEY_NUM, "records are fewer than the keys written by the contest");
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+    bool exist = access(name.c_str(), F_OK) == 0;
+    BuildMapping(name, MAP_SIZE, exist);
+
+    MapIndex(INDEX_SIZE, options.huge_pages);
+    InitRegion(exist, std::min(std::max(options.log_regions, 1u), MAX_THREAD_NUM));
+    if (exist) {
+        Recover();
+    }
+
+    auto opened = std::chrono::steady_clock::now();
+    PrintLog("[ThreadLogEngine::ThreadLogEngine] %u regions of %lu records, index %.2lf MB, open in %.2lf ms\n",
+             region_num_, region_records_, INDEX_SIZE / 1048576.0,
+             std::chrono::duration<double, std::milli>(opened - start).count());
+}
+
+
+Status ThreadLogEngine::CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file, const Options &options) {
+    log_superblock super;
+    if (ReadSuperblock(name, 0, &super, sizeof(super))) {
+        //  区域数量和大小以文件头为准，超出本次编译的 MAX_RECORDS 时索引放不下
+        if (super.magic != MAGIC || super.record_size != RECORD_SIZE || super.region_num == 0 ||
+            super.region_num > MAX_THREAD_NUM || super.region_num * super.region_records > MAX_RECORDS) {
+            if (log_file) {
+                fprintf(log_file, "[ThreadLogEngine::CreateOrOpen] %s was not created with the thread layout\n",
+                        name.c_str());
+                fflush(log_file);
+            }
+            return IOError;
+        }
+    }
+    *dbptr = new ThreadLogEngine(name, log_file, options);
+    return Ok;
+}
+
+
+/**
+ * 新文件按 region_num 把文件头之后的空间平均分给各区域，写入并持久化文件头；
+ * 已有文件沿用文件头中的划分
+ */
+void ThreadLogEngine::InitRegion(bool exist, uint32_t region_num) {
+    log_superblock *super = (log_superblock *) pmem_base_;
+    if (!exist) {
+        log_superblock init;
+        memset(&init, 0, sizeof(init));
+        init.magic = MAGIC;
+        init.region_num = region_num;
+        init.record_size = RECORD_SIZE;
+        init.region_records = MAX_RECORDS / region_num;
+        *super = init;
+        Flush(super, sizeof(log_superblock));
+        Drain();
+    }
+    region_num_ = super->region_num;
+    region_records_ = super->region_records;
+    for (uint32_t i = 0; i < MAX_THREAD_NUM; ++i) {
+        log_region &r = regions_[i];
+        r.records = i < region_num_ ? (log_record *) (pmem_base_ + SUPER_SIZE) + i * region_records_ : nullptr;
+        r.tail.store(0, std::memory_order_relaxed);
+        r.live.store(0, std::memory_order_relaxed);
+    }
+}
+
+
+/**
+ * 每个区域一个任务并行扫描，各区域的记录并发发布到同一张索引，按 stamp 决出每个 key 的最新版本
+ */
+void ThreadLogEngine::Recover() {
+    auto start = std::chrono::steady_clock::now();
+    unsigned int thread_num = std::min(std::max(1u, std::thread::hardware_concurrency()), region_num_);
+    std::atomic<uint32_t> next_region(0);
+    std::atomic<uint64_t> records(0);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < thread_num; ++i) {
+        workers.emplace_back([this, &next_region, &records]() {
+            uint32_t region;
+            while ((region = next_region.fetch_add(1, std::memory_order_relaxed)) < region_num_) {
+                records.fetch_add(RecoverRegion(region), std::memory_order_relaxed);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    uint64_t live = 0;
+    for (uint32_t i = 0; i < region_num_; ++i) {
+        live += regions_[i].live.load(std::memory_order_relaxed);
+    }
+    PrintLog("[ThreadLogEngine::Recover] %lu records, %lu keys, %u threads, %.2lf ms\n", records.load(), live,
+             thread_num, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+
+/**
+ * 区域内的空位只会出现在崩溃时还没写完的预留位置，最多是共用区域的线程数乘以未 fence 的记录数，
+ * 所以连续 EMPTY_RUN 个空位之后不再有记录。校验和不符的记录是写了一半的，跳过但仍算作已占用。
+ * 返回发布过的记录数
+ */
+uint64_t ThreadLogEngine::RecoverRegion(uint32_t region) {
+    log_region &r = regions_[region];
+    uint64_t tail = 0;
+    uint64_t empty = 0;
+    uint64_t records = 0;
+    for (uint64_t no = 0; no < region_records_ && empty < EMPTY_RUN; ++no) {
+        const log_record &record = r.records[no];
+        if (record.meta == 0 && record.stamp == 0) {
+            ++empty;
+            continue;
+        }
+        empty = 0;
+        tail = no + 1;
+        if (record.meta != VALID || record.crc != RecordCrc(record)) {
+            continue;
+        }
+        uint64_t current;
+        if (Publish(KeyHash(record.key), record.key, (uint32_t) (region * region_records_ + no + 1), record.stamp,
+                    &current)) {
+            ++records;
+        }
+    }
+    r.tail.store(tail, std::memory_order_relaxed);
+    return records;
+}
+
+
+/**
+ * 查找 key，返回索引项所在的槽，entry 为读到的索引项；不存在返回 nullptr。
+ * 记录发布后不会再被修改，读者不需要重试
+ */
+inline uint32_t *ThreadLogEngine::Find(uint64_t hash, const char *key, uint32_t *entry) {
+    uint64_t group = GroupIndex(hash);
+    uint8_t tag_byte = TagByte(hash);
+
+    while (true) {
+        index_group &g = index_[group];
+        uint32_t mask = MatchTag(g, tag_byte);
+        while (mask != 0) {
+            uint32_t *slot = g.entries + __builtin_ctz(mask);
+            uint32_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            if (memcmp(Record(cur)->key, key, KEY_SIZE) == 0) {
+                *entry = cur;
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+        if (HasEmpty(g)) {
+            return nullptr;
+        }
+        group = group + 1 == INDEX_GROUP_NUM ? 0 : group + 1;
+    }
+}
+
+
+/**
+ * 把版本为 stamp 的记录 entry 发布到索引：key 不存在时占一个空槽，已有版本比它旧时 CAS 替换。
+ * 已有版本不比它旧时返回 false，current 为已有版本的 stamp。
+ * 索引项中没有 tag，写者先比较 tag 字节，tag 字节为 0 说明别的写者已占住槽位但还没写 tag，
+ * 这时要读记录比较 key
+ */
+inline bool ThreadLogEngine::Publish(uint64_t hash, const char *key, uint32_t entry, uint64_t stamp,
+                                     uint64_t *current) {
+    uint8_t tag_byte = TagByte(hash);
+    uint64_t group = GroupIndex(hash);
+
+    while (true) {
+        index_group &g = index_[group];
+        for (uint32_t i = 0; i < GROUP_SLOT_NUM; ++i) {
+            uint32_t *slot = g.entries + i;
+            uint32_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            if (cur == 0) {
+                if (__atomic_compare_exchange_n(slot, &cur, entry, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                    __atomic_store_n(g.tags + i, tag_byte, __ATOMIC_RELEASE);
+                    regions_[(entry - 1) / region_records_].live.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            uint8_t tag = __atomic_load_n(g.tags + i, __ATOMIC_ACQUIRE);
+            if ((tag == tag_byte || tag == 0) && memcmp(Record(cur)->key, key, KEY_SIZE) == 0) {
+                //  CAS 失败时 cur 会更新为同一个 key 的另一个版本
+                while (true) {
+                    uint64_t s = Record(cur)->stamp;
+                    if (s >= stamp) {
+                        *current = s;
+                        return false;
+                    }
+                    if (__atomic_compare_exchange_n(slot, &cur, entry, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                        return true;
+                    }
+                }
+            }
+        }
+        group = group + 1 == INDEX_GROUP_NUM ? 0 : group + 1;
+    }
+}
+
+
+inline log_record *ThreadLogEngine::Record(uint32_t entry) const {
+    return (log_record *) (pmem_base_ + SUPER_SIZE) + (entry - 1);
+}
+
+
+/**
+ * 记录在栈上拼好并计算校验和，整条用非临时写落盘（记录 128 字节对齐）。
+ * 同一区域的记录首尾相接，介质写入量就是记录本身
+ */
+inline void ThreadLogEngine::WriteRecord(log_record *dst, uint64_t stamp, const char *key, const char *value) {
+    log_record record __attribute__((aligned(32)));
+    record.stamp = stamp;
+    record.meta = VALID;
+    memcpy(record.key, key, KEY_SIZE);
+    memcpy(record.value, value, VALUE_SIZE);
+    memset(record.padding, 0, sizeof(record.padding));
+    record.crc = RecordCrc(record);
+#ifdef USE_LIBPMEM
+    if (is_pmem_) {
+        NtCopy(dst, &record, RECORD_SIZE);
+    } else
+#endif
+    {
+        memcpy(dst, &record, RECORD_SIZE);
+        if (durability_ != DurabilityRelaxed) {
+            Flush(dst, RECORD_SIZE);
+        }
+    }
+
+    engine_stat &stat = Stat();
+    Add(stat.user_bytes, KEY_SIZE + VALUE_SIZE);
+    Add(stat.media_bytes, RECORD_SIZE);
+}
+
+
+inline uint32_t ThreadLogEngine::RecordCrc(const log_record &record) {
+    uint32_t crc = crc32c(&record.meta, offsetof(log_record, padding) - offsetof(log_record, meta));
+    return crc32c_extend(crc, &record.stamp, sizeof(record.stamp));
+}
+
+
+/**
+ * 组数不是 2 的幂，用乘法代替取模把 32 位 hash 映射到 [0, INDEX_GROUP_NUM)
+ */
+inline uint64_t ThreadLogEngine::GroupIndex(uint64_t hash) {
+    return ((hash & 0xffffffffull) * INDEX_GROUP_NUM) >> 32;
+}
+
+
+inline uint8_t ThreadLogEngine::TagByte(uint64_t hash) {
+    return (uint8_t) (((hash >> 32) & 0x7f) | 0x80);
+}
+
+
+/**
+ * DAX 上记录都是非临时写，只需要 fence；其他文件整体 msync
+ */
+void ThreadLogEngine::PersistAll() {
+#ifdef USE_LIBPMEM
+    if (is_pmem_) {
+        Drain();
+        return;
+    }
+#endif
+    Flush(pmem_base_, mapped_size_);
+}
+
+
+Status ThreadLogEngine::Get(const Slice &key, std::string *value) {
+    char buf[VALUE_SIZE];
+    Slice slice(buf, VALUE_SIZE);
+    Status s = Get(key, &slice);
+    if (s == Ok) {
+        value->assign(buf, VALUE_SIZE);
+    }
+    return s;
+}
+
+
+Status ThreadLogEngine::Get(const Slice &key, Slice *value) {
+    engine_stat &stat = Stat();
+    Add(stat.gets);
+    uint32_t entry;
+    if (Find(KeyHash(key.data()), key.data(), &entry) == nullptr) {
+        Add(stat.get_misses);
+        return NotFound;
+    }
+    if (UNLIKELY(value->size() < VALUE_SIZE)) {
+        value->size() = VALUE_SIZE;
+        return OutOfMemory;
+    }
+    memcpy(value->data(), Record(entry)->value, VALUE_SIZE);
+    value->size() = VALUE_SIZE;
+    return Ok;
+}
+
+
+/**
+ * 追加到本线程的区域，持久化后按 stamp 发布。两个线程同时写同一个 key 时可能取到相同的 stamp，
+ * 发布失败的一方在原位置用更大的 stamp 重写记录再发布，这样恢复后的结果与索引一致
+ */
+Status ThreadLogEngine::Set(const Slice &key, const Slice &value) {
+    engine_stat &stat = Stat();
+    Add(stat.sets);
+    if (UNLIKELY(value.size() != VALUE_SIZE)) {
+        Add(stat.set_failures);
+        return OutOfMemory;
+    }
+    uint32_t region = ThreadId() % region_num_;
+    log_region &r = regions_[region];
+    uint64_t no = r.tail.fetch_add(1, std::memory_order_relaxed);
+    if (UNLIKELY(no >= region_records_)) {
+        Add(stat.set_failures);
+        return OutOfMemory;
+    }
+
+    uint64_t hash = KeyHash(key.data());
+    uint32_t entry = (uint32_t) (region * region_records_ + no + 1);
+    uint32_t cur;
+    uint64_t stamp = Find(hash, key.data(), &cur) ? Record(cur)->stamp + 1 : 1;
+    uint64_t current;
+    while (true) {
+        WriteRecord(r.records + no, stamp, key.data(), value.data());
+        EndWrite();
+        if (LIKELY(Publish(hash, key.data(), entry, stamp, &current))) {
+            return Ok;
+        }
+        stamp = current + 1;
+    }
+}
+
+
+/**
+ * 写入最多的区域的记录数与平均值之比，对应桶布局的 nvm.bucket-skew
+ */
+double ThreadLogEngine::Skew() const {
+    uint64_t max = 0;
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < region_num_; ++i) {
+        uint64_t tail = std::min(regions_[i].tail.load(std::memory_order_relaxed), region_records_);
+        max = std::max(max, tail);
+        sum += tail;
+    }
+    return sum > 0 ? (double) max * region_num_ / sum : 0.0;
+}
+
+
+uint64_t ThreadLogEngine::LiveKeys() const {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < region_num_; ++i) {
+        n += regions_[i].live.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+
+std::string ThreadLogEngine::StatsString() {
+    uint64_t tail_max = 0;
+    uint64_t tail_sum = 0;
+    uint64_t live = 0;
+    for (uint32_t i = 0; i < region_num_; ++i) {
+        uint64_t tail = std::min(regions_[i].tail.load(std::memory_order_relaxed), region_records_);
+        tail_max = std::max(tail_max, tail);
+        tail_sum += tail;
+        live += regions_[i].live.load(std::memory_order_relaxed);
+    }
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+                       "region, count = %u, records = %lu, tail_max = %lu, tail_avg = %lu, live = %lu\n",
+                       region_num_, region_records_, tail_max, tail_sum / region_num_, live);
+    return OpsString("") + std::string(buf, std::min((size_t) len, sizeof(buf) - 1)) + IndexString("", MAX_RECORDS);
+}
+
+
+ThreadLogEngine::~ThreadLogEngine() {
+    if (durability_ == DurabilityRelaxed) {
+        PersistAll();
+    } else {
+        Drain();
+    }
+
+    std::string stats = StatsString();
+    PrintLog("%s", stats.c_str());
+
+    if (log_file_) {
+        fclose(log_file_);
+    }
+}
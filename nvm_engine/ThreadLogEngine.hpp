@@ -0,0 +1,133 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/17
+ * @project: tair-contest
+ * @desp: 按线程分区的日志布局：每个线程顺序追加写自己的日志区域，全局 DRAM 索引把 key 映射到 (区域, 记录号)
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_THREAD_LOG_ENGINE_H_
+#define TAIR_CONTEST_KV_CONTEST_THREAD_LOG_ENGINE_H_
+
+#include <atomic>
+#include <string>
+#include "PmemEngine.hpp"
+#include "XPLine.hpp"
+#include "KeyHash.hpp"
+
+
+/**
+ * 文件头，占文件开头的 4K。打开已有文件时校验 magic，区域数量和大小以文件头为准
+ */
+struct log_superblock {
+    uint64_t magic;
+    uint32_t region_num;
+    uint32_t record_size;
+    uint64_t region_records;    //  每个区域的记录数
+};
+
+
+/**
+ * 日志中的一条记录，128 字节，两条正好一个 XPLine，顺序追加时 XPBuffer 把相邻两条合并成整行写。
+ * stamp 是这个 key 的版本号，每次写入取当前版本加一，恢复时同一个 key 保留 stamp 最大的记录。
+ * meta 为 0 表示空位；crc 是 meta、key、value 和 stamp 的 CRC32C，恢复时据此识别写了一半的记录
+ */
+struct log_record {
+    uint64_t stamp;
+    uint32_t crc;
+    uint32_t meta;
+    char key[16];
+    char value[80];
+    char padding[16];
+};
+
+
+/**
+ * 一个线程的日志区域。tail 是下一条记录的位置，共用区域的线程通过 fetch_add 预留位置，
+ * live 是首次写入经过这个区域的 key 数量。独占一个 cache line，避免不同线程的区域互相干扰
+ */
+struct log_region {
+    log_record *records;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> live;
+    char padding[40];
+};
+
+
+/**
+ * Options::layout 为 LayoutThread 时使用的引擎。线程 i 只追加写区域 i % region_num_，
+ * 介质上每个线程的写入都是顺序的，记录头和记录一起写出，不需要单独的记录头写。
+ * index 是 DRAM 中按组线性探测的开放寻址表（见 index_group），全部区域共用一张，
+ * 每项为全局记录号 + 1（区域号 * region_records_ + 记录号 + 1），0 表示空。
+ * 只支持 80 字节的 value，不做压缩，区域写满后 Set 返回 OutOfMemory；
+ * 没有读缓存、检查点、异步写和原地更新，这些选项被忽略
+ */
+class ThreadLogEngine : PmemEngine {
+public:
+    ThreadLogEngine(const std::string &name, FILE *log_file, const Options &options);
+
+    /**
+     * 已有文件不是这种布局创建的时返回 IOError
+     */
+    static Status CreateOrOpen(const std::string &name, DB **dbptr, FILE *log_file, const Options &options);
+
+    Status Get(const Slice &key, std::string *value) override;
+
+    Status Get(const Slice &key, Slice *value) override;
+
+    Status Set(const Slice &key, const Slice &value) override;
+
+    ~ThreadLogEngine() override;
+
+private:
+    void InitRegion(bool exist, uint32_t region_num);
+
+    void Recover();
+
+    uint64_t RecoverRegion(uint32_t region);
+
+    inline uint32_t *Find(uint64_t hash, const char *key, uint32_t *entry);
+
+    inline bool Publish(uint64_t hash, const char *key, uint32_t entry, uint64_t stamp, uint64_t *current);
+
+    inline log_record *Record(uint32_t entry) const;
+
+    inline void WriteRecord(log_record *dst, uint64_t stamp, const char *key, const char *value);
+
+    inline static uint32_t RecordCrc(const log_record &record);
+
+    inline static uint64_t GroupIndex(uint64_t hash);
+
+    inline static uint8_t TagByte(uint64_t hash);
+
+    void PersistAll();
+
+    std::string StatsString() override;
+
+    double Skew() const override;
+
+    uint64_t LiveKeys() const override;
+
+private:
+#ifndef LOCAL
+    const static size_t MAP_SIZE = 92ull << 30ull;  //  92G，约 7.7 亿条记录，只够放下比赛写入的 key，读阶段的覆盖写没有空间
+#else
+    const static size_t MAP_SIZE = 960ull << 20ull;  //  960M
+#endif
+
+    const static uint64_t MAGIC = 0x31474f4c44524854ull;   //  "THRDLOG1"
+    const static uint64_t SUPER_SIZE = 4096;
+    const static uint64_t KEY_SIZE = 16;
+    const static uint64_t VALUE_SIZE = 80;
+    const static uint64_t RECORD_SIZE = sizeof(log_record);
+    const static uint64_t MAX_RECORDS = (MAP_SIZE - SUPER_SIZE) / RECORD_SIZE;     //  全部区域的记录数上限（771751904）
+    const static uint32_t VALID = 1;
+    const static uint64_t INDEX_GROUP_NUM = MAX_RECORDS * 4 / 3 / GROUP_SLOT_NUM + 1;  //  装载率不超过 0.75（85750212）
+    const static uint64_t INDEX_SIZE = INDEX_GROUP_NUM * sizeof(index_group);      //  每条记录约 7.1 字节（5.11G）
+    const static uint64_t INDEX_BUDGET = 8ull << 30ull;
+    const static uint64_t EMPTY_RUN = 4096;     //  恢复时连续这么多空位之后不再有记录
+    uint32_t region_num_;
+    uint64_t region_records_;
+    log_region regions_[MAX_THREAD_NUM];
+};
+
+#endif
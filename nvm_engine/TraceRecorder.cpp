@@ -0,0 +1,157 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/23
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <immintrin.h>
+#include "TraceRecorder.hpp"
+
+
+static inline uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+TraceRecorder::TraceRecorder(DB *db, const std::string &path, FILE *log_file)
+        : db_(db), start_ns_(NowNs()), record_num_(0), block_num_(0), max_value_size_(0), log_file_(log_file) {
+    if ((file_ = fopen(path.c_str(), "wb")) == nullptr) {
+        perror("[TraceRecorder::TraceRecorder] open trace file failed");
+        exit(1);
+    }
+    //  先占住文件头的位置，析构时再写入统计
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    fwrite(&header, sizeof(header), 1, file_);
+
+    buffers_ = new trace_buffer[MAX_THREAD_NUM];
+    for (uint32_t i = 0; i < MAX_THREAD_NUM; ++i) {
+        buffers_[i].lock.store(0, std::memory_order_relaxed);
+        buffers_[i].block.thread = i;
+        buffers_[i].block.record_num = 0;
+    }
+    PrintLog("[TraceRecorder::TraceRecorder] recording requests to %s\n", path.c_str());
+}
+
+
+inline void TraceRecorder::Lock(trace_buffer &buffer) {
+    while (buffer.lock.exchange(1, std::memory_order_acquire)) {
+        _mm_pause();
+    }
+}
+
+
+inline void TraceRecorder::Unlock(trace_buffer &buffer) {
+    buffer.lock.store(0, std::memory_order_release);
+}
+
+
+/**
+ * 追加到当前线程槽的缓冲区，满了就写出整个 block
+ */
+inline void TraceRecorder::Record(uint8_t op, const Slice &key, uint64_t value_size) {
+    trace_buffer &buffer = buffers_[ThreadId()];
+    Lock(buffer);
+    trace_record &record = buffer.records[buffer.block.record_num++];
+    record.time_ns = NowNs() - start_ns_;
+    record.value_size = (uint32_t) value_size;
+    record.op = op;
+    memset(record.reserved, 0, sizeof(record.reserved));
+    memset(record.key, 0, sizeof(record.key));
+    memcpy(record.key, key.data(), std::min(key.size(), (uint64_t) sizeof(record.key)));
+    if (buffer.block.record_num == BLOCK_RECORD_NUM) {
+        Flush(buffer);
+    }
+    Unlock(buffer);
+
+    uint32_t max_size = max_value_size_.load(std::memory_order_relaxed);
+    while (value_size > max_size &&
+           !max_value_size_.compare_exchange_weak(max_size, (uint32_t) value_size, std::memory_order_relaxed)) {
+    }
+}
+
+
+/**
+ * 调用者持有该槽的锁，或者已经没有其他线程访问
+ */
+void TraceRecorder::Flush(trace_buffer &buffer) {
+    if (buffer.block.record_num == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(file_mut_);
+    fwrite(&buffer.block, sizeof(trace_block), 1, file_);
+    fwrite(buffer.records, sizeof(trace_record), buffer.block.record_num, file_);
+    record_num_ += buffer.block.record_num;
+    ++block_num_;
+    buffer.block.record_num = 0;
+}
+
+
+Status TraceRecorder::Get(const Slice &key, std::string *value) {
+    Record(TRACE_GET, key, 0);
+    return db_->Get(key, value);
+}
+
+
+Status TraceRecorder::Get(const Slice &key, Slice *value) {
+    Record(TRACE_GET, key, 0);
+    return db_->Get(key, value);
+}
+
+
+Status TraceRecorder::Set(const Slice &key, const Slice &value) {
+    Record(TRACE_SET, key, value.size());
+    return db_->Set(key, value);
+}
+
+
+void TraceRecorder::MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) {
+    for (size_t i = 0; i < n; ++i) {
+        Record(TRACE_GET, keys[i], 0);
+    }
+    db_->MultiGet(n, keys, values, statuses);
+}
+
+
+void TraceRecorder::MultiSet(size_t n, const Slice *keys, const Slice *values, Status *statuses) {
+    for (size_t i = 0; i < n; ++i) {
+        Record(TRACE_SET, keys[i], values[i].size());
+    }
+    db_->MultiSet(n, keys, values, statuses);
+}
+
+
+bool TraceRecorder::GetProperty(const std::string &property, std::string *value) {
+    return db_->GetProperty(property, value);
+}
+
+
+TraceRecorder::~TraceRecorder() {
+    for (uint32_t i = 0; i < MAX_THREAD_NUM; ++i) {
+        Flush(buffers_[i]);
+    }
+    delete[] buffers_;
+
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.max_value_size = max_value_size_.load();
+    header.record_num = record_num_;
+    header.block_num = block_num_;
+    fseek(file_, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file_);
+    fclose(file_);
+    PrintLog("[TraceRecorder::~TraceRecorder] recorded %lu requests in %lu blocks\n", record_num_, block_num_);
+
+    //  被包装的 DB 析构时会关闭 log_file_，放在最后
+    delete db_;
+}
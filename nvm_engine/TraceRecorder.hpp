@@ -0,0 +1,79 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/23
+ * @project: tair-contest
+ * @desp: 记录请求 trace 的 DB 包装，格式见 include/trace.hpp
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_TRACE_RECORDER_H_
+#define TAIR_CONTEST_KV_CONTEST_TRACE_RECORDER_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include "Statement.hpp"
+
+#ifndef CLION
+#include "include/trace.hpp"
+#else
+#include "trace.hpp"
+#endif
+
+
+/**
+ * 每个线程槽一个缓冲区，攒满一个 block 再加锁写文件，缓冲区 32K，相邻槽之间几乎没有伪共享。
+ * 同时存活的线程超过 MAX_THREAD_NUM 时多个线程共用槽，所以仍需要 lock
+ */
+struct trace_buffer {
+    std::atomic<uint8_t> lock;
+    trace_block block;
+    trace_record records[1024];
+};
+
+
+/**
+ * 包装任意 DB：先记录请求，再转发给被包装的 DB。
+ * 析构时写出剩余的缓冲区并补全文件头，被包装的 DB 一起析构
+ */
+class TraceRecorder : public DB {
+public:
+    TraceRecorder(DB *db, const std::string &path, FILE *log_file);
+
+    Status Get(const Slice &key, std::string *value) override;
+
+    Status Get(const Slice &key, Slice *value) override;
+
+    Status Set(const Slice &key, const Slice &value) override;
+
+    void MultiGet(size_t n, const Slice *keys, Slice *values, Status *statuses) override;
+
+    void MultiSet(size_t n, const Slice *keys, const Slice *values, Status *statuses) override;
+
+    bool GetProperty(const std::string &property, std::string *value) override;
+
+    ~TraceRecorder() override;
+
+private:
+    inline void Record(uint8_t op, const Slice &key, uint64_t value_size);
+
+    inline void Lock(trace_buffer &buffer);
+
+    inline void Unlock(trace_buffer &buffer);
+
+    void Flush(trace_buffer &buffer);
+
+private:
+    const static uint32_t BLOCK_RECORD_NUM = sizeof(trace_buffer::records) / sizeof(trace_record);
+
+    DB *db_;
+    FILE *file_;
+    uint64_t start_ns_;
+    std::mutex file_mut_;
+    uint64_t record_num_;
+    uint64_t block_num_;
+    std::atomic<uint32_t> max_value_size_;
+    trace_buffer *buffers_;
+    FILE *log_file_;
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/17
+ * @project: tair-contest
+ * @desp:
+ */
+
+#include <cstring>
+#include <immintrin.h>
+#include "WriteRing.hpp"
+
+
+WriteRing::WriteRing(uint64_t capacity) : head_(0), tail_(0), lock_(false) {
+    uint64_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    mask_ = size - 1;
+    hashes_ = new uint64_t[size];
+    records_ = new char[size * RECORD_SIZE];
+}
+
+
+WriteRing::~WriteRing() {
+    delete[] hashes_;
+    delete[] records_;
+}
+
+
+void WriteRing::Lock() {
+    while (lock_.exchange(true, std::memory_order_acquire)) {
+        _mm_pause();
+    }
+}
+
+
+void WriteRing::Unlock() {
+    lock_.store(false, std::memory_order_release);
+}
+
+
+bool WriteRing::TryPush(uint64_t hash, const char *key, const char *value) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+        return false;
+    }
+    uint64_t pos = head & mask_;
+    hashes_[pos] = hash;
+    memcpy(records_ + pos * RECORD_SIZE, key, KEY_SIZE);
+    memcpy(records_ + pos * RECORD_SIZE + KEY_SIZE, value, VALUE_SIZE);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+
+/**
+ * 只有生产者写记录，持有 Lock 时读到的记录不会变化；消费者同时推进 tail 也没关系，
+ * 被取出的记录已经发布，这里返回的仍是这个 key 最后入队的值
+ */
+bool WriteRing::Find(uint64_t hash, const char *key, char *buf) const {
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while (head != tail) {
+        uint64_t pos = --head & mask_;
+        if (hashes_[pos] == hash && memcmp(records_ + pos * RECORD_SIZE, key, KEY_SIZE) == 0) {
+            memcpy(buf, records_ + pos * RECORD_SIZE + KEY_SIZE, VALUE_SIZE);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+uint64_t WriteRing::Peek(uint64_t max, uint64_t *begin) const {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    *begin = tail;
+    return head - tail < max ? head - tail : max;
+}
+
+
+uint64_t WriteRing::Hash(uint64_t pos) const {
+    return hashes_[pos & mask_];
+}
+
+
+const char *WriteRing::Key(uint64_t pos) const {
+    return records_ + (pos & mask_) * RECORD_SIZE;
+}
+
+
+const char *WriteRing::Value(uint64_t pos) const {
+    return records_ + (pos & mask_) * RECORD_SIZE + KEY_SIZE;
+}
+
+
+void WriteRing::Pop(uint64_t n) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+
+bool WriteRing::Empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+}
+
+
+uint64_t WriteRing::Head() const {
+    return head_.load(std::memory_order_acquire);
+}
+
+
+bool WriteRing::Drained(uint64_t pos) const {
+    return tail_.load(std::memory_order_acquire) >= pos;
+}
@@ -0,0 +1,94 @@
+/*
+ * @author: shenke
+ * @date: 2020/10/17
+ * @project: tair-contest
+ * @desp: 异步写模式下每个刷写线程一个的 DRAM 环形队列，客户端线程写入，刷写线程取出写到 PMem
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_WRITE_RING_H_
+#define TAIR_CONTEST_KV_CONTEST_WRITE_RING_H_
+
+#include <atomic>
+#include "Statement.hpp"
+
+
+/**
+ * 多生产者单消费者队列。[tail, head) 是还没有写到 PMem 的记录，生产者持有 Lock 写记录并推进 head，
+ * 消费者只写 tail，按入队顺序取出。
+ * 消费者先把取出的记录发布到索引，再推进 tail，所以不在 [tail, head) 中的记录一定已经能从索引查到
+ */
+class WriteRing {
+public:
+    /**
+     * @param
+     * capacity: 记录数，向上取整到 2 的幂
+     */
+    explicit WriteRing(uint64_t capacity);
+
+    ~WriteRing();
+
+    //  <-------- 生产者，持有 Lock -------->
+
+    void Lock();
+
+    void Unlock();
+
+    /**
+     * 队列已满返回 false
+     */
+    bool TryPush(uint64_t hash, const char *key, const char *value);
+
+    /**
+     * 从新到旧查找队列中还没有写到 PMem 的 key，找到时把 value 拷贝到 buf（VALUE_SIZE 字节）
+     */
+    bool Find(uint64_t hash, const char *key, char *buf) const;
+
+    //  <-------- 消费者 -------->
+
+    /**
+     * 从 *begin 开始有多少条可以取出，最多 max 条
+     */
+    uint64_t Peek(uint64_t max, uint64_t *begin) const;
+
+    uint64_t Hash(uint64_t pos) const;
+
+    const char *Key(uint64_t pos) const;
+
+    const char *Value(uint64_t pos) const;
+
+    /**
+     * 前 n 条已经发布到索引
+     */
+    void Pop(uint64_t n);
+
+    //  <-------- 任意线程 -------->
+
+    bool Empty() const;
+
+    /**
+     * 下一条入队记录的位置
+     */
+    uint64_t Head() const;
+
+    /**
+     * pos 之前的记录都已经出队
+     */
+    bool Drained(uint64_t pos) const;
+
+private:
+    const static uint64_t KEY_SIZE = 16;
+    const static uint64_t VALUE_SIZE = 80;
+    const static uint64_t RECORD_SIZE = KEY_SIZE + VALUE_SIZE;
+
+    //  生产者和消费者各自写的变量分开放在不同的 cache line
+    std::atomic<uint64_t> head_;
+    char padding0_[56];
+    std::atomic<uint64_t> tail_;
+    char padding1_[56];
+    std::atomic<bool> lock_;
+    uint64_t mask_;
+    uint64_t *hashes_;      //  与记录分开存放，查找时连续比较 hash
+    char *records_;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * @author: shenke
+ * @date: 2020/9/14
+ * @project: tair-contest
+ * @desp: Optane 以 256 字节的 XPLine 为单位写介质，这里是绕过 cache 的非临时写工具
+ */
+
+#ifndef TAIR_CONTEST_KV_CONTEST_XPLINE_H_
+#define TAIR_CONTEST_KV_CONTEST_XPLINE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+const static uint64_t XPLINE_SIZE = 256;
+
+/**
+ * 用非临时写把 src 拷贝到 dst，数据不经过 cache，不需要再 clflush/clwb。
+ * dst 至少 32 字节对齐（没有 AVX2 时 16 字节），len 是对齐粒度的整数倍。
+ * 只保证发出写，调用者在一批写之后执行一次 NtFence
+ */
+inline void NtCopy(void *dst, const void *src, size_t len) {
+    char *d = (char *) dst;
+    const char *s = (const char *) src;
+    const char *end = s + len;
+#if defined(__AVX512F__)
+    while (((uintptr_t) d & 63) != 0 && s < end) {
+        _mm256_stream_si256((__m256i *) d, _mm256_loadu_si256((const __m256i *) s));
+        d += 32;
+        s += 32;
+    }
+    for (; s + 64 <= end; d += 64, s += 64) {
+        _mm512_stream_si512((__m512i *) d, _mm512_loadu_si512((const void *) s));
+    }
+    for (; s < end; d += 32, s += 32) {
+        _mm256_stream_si256((__m256i *) d, _mm256_loadu_si256((const __m256i *) s));
+    }
+#elif defined(__AVX2__)
+    for (; s < end; d += 32, s += 32) {
+        _mm256_stream_si256((__m256i *) d, _mm256_loadu_si256((const __m256i *) s));
+    }
+#else
+    for (; s < end; d += 16, s += 16) {
+        _mm_stream_si128((__m128i *) d, _mm_loadu_si128((const __m128i *) s));
+    }
+#endif
+}
+
+
+inline void NtFence() {
+    _mm_sfence();
+}
+
+
+/**
+ * [addr, addr + len) 跨越的 XPLine 数量，乘以 XPLINE_SIZE 即介质实际写入量的上界
+ */
+inline uint64_t XPLineCount(const void *addr, size_t len) {
+    uintptr_t first = (uintptr_t) addr / XPLINE_SIZE;
+    uintptr_t last = ((uintptr_t) addr + len - 1) / XPLINE_SIZE;
+    return last - first + 1;
+}
+
+#endif
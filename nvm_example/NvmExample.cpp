@@ -8,10 +8,15 @@
 #include <cstring>
 #include <mutex>
 #include <string>
+#include <algorithm>
 #include <unordered_map>
 
 Status DB::CreateOrOpen(const std::string& name, DB** dbptr, FILE* log_file) {
-    return NvmExample::CreateOrOpen(name, dbptr);
+    return NvmExample::CreateOrOpen(name, dbptr, log_file);
+}
+
+Status DB::CreateOrOpen(const std::string& name, DB** dbptr, FILE* log_file, const Options& options) {
+    return NvmExample::CreateOrOpen(name, dbptr, log_file, options);
 }
 
 DB::~DB() {}
@@ -43,7 +48,8 @@ void LogAppender::RecoveryHelper::_get_slice(Slice& slice) {
     *_end_off = pmem_addr - _pmem_base;
 }
 
-LogAppender::LogAppender(const char* file_name, size_t size) {
+LogAppender::LogAppender(const char* file_name, size_t size)
+    : _end_off(0), _block_off(0), _appended(0), _synced(0), _user_bytes(0), _media_bytes(0) {
 #ifdef USE_LIBPMEM
     if ((_pmem.pmem_base = (char*)pmem_map_file(file_name, size,
                                                 PMEM_FILE_CREATE,
@@ -68,15 +74,50 @@ void LogAppender::Recovery(std::unordered_map<std::string, Slice>& hash_map) {
             break;
         hash_map[kv.first.to_string()] = kv.second;
     }
+    _block_off = _end_off & ~(XPLINE_SIZE - 1);
+    memcpy(_block, _pmem.pmem_base + _block_off, XPLINE_SIZE);
+    _appended = _synced = *_pmem.sequence;
 }
 
+// Only stages the record; full XPLines are written back as they fill and
+// the rest waits for Sync, so small appends do not rewrite the same line.
+// The returned slices point into the mapping; read them through Read,
+// their tail may still be staged in DRAM.
 std::pair<Slice, Slice> LogAppender::Append(const Slice& key, const Slice& val) {
     Slice nvm_key = _push_back(key);
     Slice nvm_val = _push_back(val);
-    (*_pmem.sequence)++;
+    _appended++;
     return std::make_pair(nvm_key, nvm_val);
 }
 
+// Writes back the partially filled XPLine, then publishes the record
+// count. The count is only persisted after the records it covers.
+void LogAppender::Sync() {
+    if (_synced == _appended)
+        return;
+    _flush_block();
+    *_pmem.sequence = _appended;
+    if (_block_off == 0)
+        memcpy(_block, _pmem.sequence, sizeof(uint64_t));
+    _persist(_pmem.sequence, sizeof(uint64_t));
+    _media_bytes += XPLINE_SIZE;
+    _synced = _appended;
+}
+
+// Every line before _block_off has been written back; the rest of the
+// slice is only in the staged block.
+void LogAppender::Read(const Slice& slice, char* dst) const {
+    uint64_t off = slice.data() - _pmem.pmem_base;
+    uint64_t n = off < _block_off ? std::min(slice.size(), _block_off - off) : 0;
+    memcpy(dst, slice.data(), n);
+    if (n < slice.size())
+        memcpy(dst + n, _block + (off + n - _block_off), slice.size() - n);
+}
+
+double LogAppender::WriteAmplification() const {
+    return _user_bytes ? (double)_media_bytes / _user_bytes : 0.0;
+}
+
 LogAppender::~LogAppender() {
 
 #ifdef USE_LIBPMEM
@@ -96,24 +137,71 @@ void LogAppender::_persist(void* addr, uint32_t len) {
 }
 
 Slice LogAppender::_push_back(const Slice& slice) {
-    char* ptr = _pmem.pmem_base + _end_off;
-    *(uint64_t*)ptr = slice.size();
-    _persist(ptr, sizeof(uint64_t));
-    ptr += sizeof(uint64_t);
-    Slice ret(ptr, slice.size());
-    memcpy(ptr, slice.data(), slice.size());
-    _persist(ptr, slice.size());
-    _end_off = _end_off + sizeof(uint64_t) + slice.size();
+    uint64_t size = slice.size();
+    _stage(&size, sizeof(uint64_t));
+    Slice ret(_pmem.pmem_base + _end_off, slice.size());
+    _stage(slice.data(), slice.size());
+    _user_bytes += sizeof(uint64_t) + slice.size();
     return ret;
 }
 
-NvmExample::NvmExample(const std::string& name)
-    : logger(name.c_str(), SIZE) {
+void LogAppender::_stage(const void* src, uint64_t len) {
+    const char* ptr = (const char*)src;
+    while (len > 0) {
+        uint64_t in_block = _end_off - _block_off;
+        uint64_t n = std::min(len, XPLINE_SIZE - in_block);
+        memcpy(_block + in_block, ptr, n);
+        _end_off += n;
+        ptr += n;
+        len -= n;
+        if (_end_off - _block_off == XPLINE_SIZE) {
+            _flush_block();
+            _block_off += XPLINE_SIZE;
+            memset(_block, 0, XPLINE_SIZE);
+        }
+    }
+}
+
+// Writes the staged XPLine back with non-temporal stores and a single sfence,
+// so the media sees one full 256-byte write instead of several partial ones.
+void LogAppender::_flush_block() {
+    if (_end_off == _block_off)
+        return;
+    char* dst = _pmem.pmem_base + _block_off;
+#ifdef USE_LIBPMEM
+    if (_is_pmem) {
+#if defined(__AVX512F__)
+        for (uint64_t i = 0; i < XPLINE_SIZE; i += 64)
+            _mm512_stream_si512((__m512i*)(dst + i), _mm512_loadu_si512((const void*)(_block + i)));
+#elif defined(__AVX2__)
+        for (uint64_t i = 0; i < XPLINE_SIZE; i += 32)
+            _mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(_block + i)));
+#else
+        for (uint64_t i = 0; i < XPLINE_SIZE; i += 16)
+            _mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(_block + i)));
+#endif
+        _mm_sfence();
+    } else {
+        memcpy(dst, _block, XPLINE_SIZE);
+        _persist(dst, XPLINE_SIZE);
+    }
+#else
+    memcpy(dst, _block, XPLINE_SIZE);
+#endif
+    _media_bytes += XPLINE_SIZE;
+}
+
+NvmExample::NvmExample(const std::string& name, FILE* log_file, const Options& options)
+    : logger(name.c_str(), SIZE),
+      durability(options.durability),
+      sync_appends(options.durability == DurabilityGroup ? std::max(options.group_persist_records, 1u) : 1),
+      pending(0),
+      log_file(log_file) {
     logger.Recovery(hash_map);
 }
 
-Status NvmExample::CreateOrOpen(const std::string& name, DB** dbptr, FILE* log_file) {
-    NvmExample* db = new NvmExample(name);
+Status NvmExample::CreateOrOpen(const std::string& name, DB** dbptr, FILE* log_file, const Options& options) {
+    NvmExample* db = new NvmExample(name, log_file, options);
     *dbptr = db;
     return Ok;
 }
@@ -124,15 +212,41 @@ Status NvmExample::Get(const Slice& key, std::string* value) {
     if (kv == hash_map.end()) {
         return NotFound;
     }
-    *value = kv->second.to_string();
+    value->resize(kv->second.size());
+    logger.Read(kv->second, &(*value)[0]);
+    return Ok;
+}
+
+Status NvmExample::Get(const Slice& key, Slice* value) {
+    std::lock_guard<std::mutex> lock(mut);
+    auto kv = hash_map.find(key.to_string());
+    if (kv == hash_map.end()) {
+        return NotFound;
+    }
+    if (value->size() < kv->second.size()) {
+        value->size() = kv->second.size();
+        return OutOfMemory;
+    }
+    logger.Read(kv->second, value->data());
+    value->size() = kv->second.size();
     return Ok;
 }
 
 Status NvmExample::Set(const Slice& key, const Slice& value) {
     std::lock_guard<std::mutex> lock(mut);
     auto kv = logger.Append(key, value);
-    hash_map[kv.first.to_string()] = kv.second;
+    if (durability != DurabilityRelaxed && ++pending >= sync_appends) {
+        logger.Sync();
+        pending = 0;
+    }
+    hash_map[key.to_string()] = kv.second;
     return Ok;
 }
 
-NvmExample::~NvmExample() {}
+NvmExample::~NvmExample() {
+    logger.Sync();
+    if (log_file) {
+        fprintf(log_file, "write amplification: %.2lf\n", logger.WriteAmplification());
+        fflush(log_file);
+    }
+}
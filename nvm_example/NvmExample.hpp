@@ -6,6 +6,7 @@
 
 #include <cstdio>
 #include <cstring>
+#include <immintrin.h>
 #include <include/db.hpp>
 #include <mutex>
 #include <string>
@@ -13,9 +14,14 @@
 
 class LogAppender {
 public:
+    const static uint64_t XPLINE_SIZE = 256;
+
     LogAppender(const char* file_name, size_t size);
     std::pair<Slice, Slice> Append(const Slice& key, const Slice& val);
+    void Sync();
+    void Read(const Slice& slice, char* dst) const;
     void Recovery(std::unordered_map<std::string, Slice>& hash_map);
+    double WriteAmplification() const;
     ~LogAppender();
 
     class RecoveryHelper {
@@ -33,6 +39,8 @@ public:
 
 private:
     Slice _push_back(const Slice& key);
+    void _stage(const void* src, uint64_t len);
+    void _flush_block();
     void _persist(void* addr, uint32_t len);
     union {
         uint64_t* sequence;
@@ -43,21 +51,41 @@ private:
     int _is_pmem;
 #endif
     uint64_t _end_off;
+    // DRAM copy of the XPLine that _end_off falls in; appends are staged here
+    // and written back as a whole 256-byte line with non-temporal stores.
+    char _block[XPLINE_SIZE];
+    uint64_t _block_off;
+    // Records appended so far, and the count last published at offset 0.
+    // Recovery only replays the published ones.
+    uint64_t _appended;
+    uint64_t _synced;
+    uint64_t _user_bytes;
+    uint64_t _media_bytes;
 };
 
 class NvmExample : DB {
 public:
     const static size_t SIZE = 0x1000000;
 
-    static Status CreateOrOpen(const std::string& name, DB** dbptr, FILE* log_file = nullptr);
+    static Status CreateOrOpen(const std::string& name, DB** dbptr, FILE* log_file = nullptr,
+                               const Options& options = Options());
 
-    NvmExample(const std::string& name);
+    // Options::durability decides when Set syncs the log: strict syncs
+    // before every Set returns, group once per group_persist_records
+    // Sets (a power failure loses at most the unsynced ones), relaxed
+    // only on close.
+    NvmExample(const std::string& name, FILE* log_file = nullptr, const Options& options = Options());
     Status Get(const Slice& key, std::string* value) override;
+    Status Get(const Slice& key, Slice* value) override;
     Status Set(const Slice& key, const Slice& value) override;
     ~NvmExample() override;
 
 private:
     LogAppender logger;
+    Durability durability;
+    uint32_t sync_appends;
+    uint32_t pending;
+    FILE* log_file;
     std::mutex mut;
     std::unordered_map<std::string, Slice> hash_map;
 };
@@ -0,0 +1,146 @@
+#include <include/db.hpp>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+//  Writers load cold keys to 60% of a LOCAL build's capacity, then overwrite a small hot set
+//  until more records than the file holds have been written: every bucket log wraps and Set only
+//  succeeds if it waits for the compactor, like the get phase of the contest. Readers check that a
+//  hot key never returns another key's value or an older round; after the writers finish, and again
+//  after reopening, every hot key holds its last round and every cold key its only value.
+//  Usage: ./compaction_test [rounds]
+
+static const char *PATH = "./tmp_compaction";
+static const int WRITERS = 4;
+static const int READERS = 2;
+static const uint32_t HOT_KEYS = 32768;
+static const uint32_t COLD_KEYS = 6u << 20;
+
+static void make_key(char *key, uint32_t id) {
+    memset(key, 0, 16);
+    memcpy(key, &id, sizeof(id));
+    key[8] = 'c';
+}
+
+static void make_value(char *value, uint32_t id, uint32_t round) {
+    memset(value, 'a' + (id + round) % 26, 80);
+    memcpy(value, &id, sizeof(id));
+    memcpy(value + 4, &round, sizeof(round));
+}
+
+//  the round stored for key id, -1 if the key is missing or holds a value that is not one of its own
+static int64_t read_round(DB *db, uint32_t id) {
+    char key[16], buf[80], expected[80];
+    make_key(key, id);
+    Slice out(buf, 80);
+    if (db->Get(Slice(key, 16), &out) != Ok || out.size() != 80) {
+        return -1;
+    }
+    uint32_t round;
+    memcpy(&round, buf + 4, sizeof(round));
+    make_value(expected, id, round);
+    return memcmp(buf, expected, 80) == 0 ? round : -1;
+}
+
+static int64_t stats_counter(DB *db, const char *name) {
+    std::string stats;
+    if (!db->GetProperty("nvm.stats", &stats)) {
+        return -1;
+    }
+    size_t pos = stats.find(name);
+    return pos == std::string::npos ? -1 : atoll(stats.c_str() + pos + strlen(name));
+}
+
+static DB *open_db() {
+    Options options;
+    options.durability = DurabilityRelaxed;
+    options.stats_dump_period_sec = 0;
+    DB *db = nullptr;
+    return DB::CreateOrOpen(PATH, &db, fopen("/dev/null", "w"), options) == Ok ? db : nullptr;
+}
+
+int main(int argc, char **argv) {
+    const uint32_t rounds = argc > 1 ? atoi(argv[1]) : 256;
+    unlink(PATH);
+    DB *db = open_db();
+    if (db == nullptr) {
+        printf("open %s failed\n", PATH);
+        return 1;
+    }
+
+    std::atomic<uint64_t> failures(0), bad(0);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < WRITERS; ++t) {
+        threads.emplace_back([&, t]() {
+            char key[16], value[80];
+            for (uint32_t id = HOT_KEYS + t; id < HOT_KEYS + COLD_KEYS; id += WRITERS) {
+                make_key(key, id);
+                make_value(value, id, 0);
+                if (db->Set(Slice(key, 16), Slice(value, 80)) != Ok) {
+                    ++failures;
+                }
+            }
+            for (uint32_t round = 0; round < rounds; ++round) {
+                for (uint32_t id = t; id < HOT_KEYS; id += WRITERS) {
+                    make_key(key, id);
+                    make_value(value, id, round);
+                    if (db->Set(Slice(key, 16), Slice(value, 80)) != Ok) {
+                        ++failures;
+                    }
+                }
+            }
+        });
+    }
+    for (int t = 0; t < READERS; ++t) {
+        threads.emplace_back([&, t]() {
+            std::vector<int64_t> seen(HOT_KEYS, -1);
+            uint32_t x = t + 1;
+            while (!done.load()) {
+                x = x * 1103515245 + 12345;
+                uint32_t id = (x >> 8) % HOT_KEYS;
+                int64_t round = read_round(db, id);
+                //  a key not written yet is missing, once written it must only move forward
+                if ((round < 0 && seen[id] >= 0) || round < seen[id]) {
+                    ++bad;
+                }
+                seen[id] = round;
+            }
+        });
+    }
+    for (int t = 0; t < WRITERS; ++t) {
+        threads[t].join();
+    }
+    done.store(true);
+    for (int t = WRITERS; t < WRITERS + READERS; ++t) {
+        threads[t].join();
+    }
+
+    int64_t segments = stats_counter(db, "compaction, segments = ");
+    for (uint32_t id = 0; id < HOT_KEYS; ++id) {
+        bad += read_round(db, id) != rounds - 1;
+    }
+    delete db;
+
+    db = open_db();
+    if (db == nullptr) {
+        printf("reopen %s failed\n", PATH);
+        return 1;
+    }
+    uint64_t lost = 0;
+    for (uint32_t id = 0; id < HOT_KEYS + COLD_KEYS; ++id) {
+        lost += read_round(db, id) != (id < HOT_KEYS ? rounds - 1 : 0);
+    }
+    delete db;
+    unlink(PATH);
+
+    printf("writes %lu, failures %lu, bad reads %lu, lost after reopen %lu, compacted segments %ld\n",
+           (uint64_t) rounds * HOT_KEYS + COLD_KEYS, failures.load(), bad.load(), lost, segments);
+    if (failures != 0 || bad != 0 || lost != 0) {
+        return 1;
+    }
+    printf("compaction_test passed\n");
+    return 0;
+}
@@ -1,7 +1,13 @@
-rm -rf ./test
+rm -rf ./test ./recovery_test ./compaction_test ./thread_layout_test
 
 g++ -std=c++11 -o test -g -I.. test.cpp -L../lib -lengine -lpthread -lrt -lz -lpmem
+g++ -std=c++11 -o recovery_test -g -I.. recovery_test.cpp -L../lib -lengine -lpthread -lrt -lz -lpmem
+g++ -std=c++11 -o compaction_test -O2 -g -I.. compaction_test.cpp -L../lib -lengine -lpthread -lrt -lz -lpmem
+g++ -std=c++11 -o thread_layout_test -O2 -g -I.. thread_layout_test.cpp -L../lib -lengine -lpthread -lrt -lz -lpmem
 
-rm -rf ./tmp
+rm -rf ./tmp ./tmp_recovery ./tmp_compaction ./tmp_thread_layout
 
 ./test
+./recovery_test
+./compaction_test
+./thread_layout_test
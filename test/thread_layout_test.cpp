@@ -0,0 +1,112 @@
+#include <include/db.hpp>
+#include <unistd.h>
+#include <string>
+#include <thread>
+
+//  With LayoutThread a writer whose region is full gets OutOfMemory for new keys and overwrites alike,
+//  while everything acknowledged before stays readable, also after reopening, and threads writing to
+//  other regions are not affected. 64 regions keep the region of the single writer small.
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1;                                                      \
+        }                                                                  \
+    } while (0)
+
+static const char *PATH = "./tmp_thread_layout";
+static const uint64_t MAX_KEYS = 64ull << 20;   //  more than a region of the contest build holds
+
+static void make_key(char *key, uint64_t id) {
+    memset(key, 0, 16);
+    memcpy(key, &id, sizeof(id));
+    key[8] = 't';
+}
+
+static void make_value(char *value, uint64_t id, uint32_t version) {
+    memset(value, 'a' + (id + version) % 26, 80);
+    memcpy(value, &id, sizeof(id));
+    memcpy(value + 8, &version, sizeof(version));
+}
+
+static Status set(DB *db, uint64_t id, uint32_t version) {
+    char key[16], value[80];
+    make_key(key, id);
+    make_value(value, id, version);
+    return db->Set(Slice(key, 16), Slice(value, 80));
+}
+
+//  Ok if the key holds the given version, NotFound if it is absent, IOError on any other value
+static Status get(DB *db, uint64_t id, uint32_t version) {
+    char key[16], value[80], buf[80];
+    make_key(key, id);
+    make_value(value, id, version);
+    Slice out(buf, 80);
+    Status s = db->Get(Slice(key, 16), &out);
+    if (s == Ok && (out.size() != 80 || memcmp(buf, value, 80) != 0)) {
+        return IOError;
+    }
+    return s;
+}
+
+static uint64_t property(DB *db, const char *name) {
+    std::string value;
+    return db->GetProperty(name, &value) ? strtoull(value.c_str(), nullptr, 10) : 0;
+}
+
+//  the engine writes its log to log_file and closes it when deleted
+static Status open_db(DB **db) {
+    Options options;
+    options.layout = LayoutThread;
+    options.log_regions = 64;
+    options.stats_dump_period_sec = 0;
+    return DB::CreateOrOpen(PATH, db, fopen("/dev/null", "w"), options);
+}
+
+int main() {
+    DB *db = nullptr;
+    unlink(PATH);
+    CHECK(open_db(&db) == Ok);
+
+    uint64_t acked = 0;
+    Status s;
+    while ((s = set(db, acked, 1)) == Ok && acked < MAX_KEYS) {
+        ++acked;
+    }
+    CHECK(s == OutOfMemory);
+    CHECK(acked > 0);
+    //  the region stays full: neither a new key nor an overwrite fits, and the old value is kept
+    CHECK(set(db, acked + 1, 1) == OutOfMemory);
+    CHECK(set(db, 0, 2) == OutOfMemory);
+    CHECK(get(db, 0, 1) == Ok);
+    CHECK(get(db, acked, 1) == NotFound);
+    CHECK(property(db, "nvm.set-failures") == 3);
+    CHECK(property(db, "nvm.live-keys") == acked);
+    delete db;
+
+    CHECK(open_db(&db) == Ok);
+    CHECK(property(db, "nvm.live-keys") == acked);
+    for (uint64_t id = 0; id < acked; ++id) {
+        CHECK(get(db, id, 1) == Ok);
+    }
+    CHECK(get(db, acked, 1) == NotFound);
+    CHECK(set(db, 0, 2) == OutOfMemory);
+    //  another thread appends to its own region
+    std::thread other([db, &s]() {
+        s = set(db, 0, 3);
+    });
+    other.join();
+    CHECK(s == Ok);
+    CHECK(get(db, 0, 3) == Ok);
+    delete db;
+
+    CHECK(open_db(&db) == Ok);
+    CHECK(get(db, 0, 3) == Ok);
+    CHECK(get(db, acked - 1, 1) == Ok);
+    delete db;
+
+    unlink(PATH);
+    printf("thread_layout_test passed, %lu keys filled a region\n", acked);
+    return 0;
+}